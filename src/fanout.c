@@ -0,0 +1,322 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include "fanout.h"
+#include "transport.h"
+
+#define LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+static long futex(uint32_t *word, int op, uint32_t value)
+{
+  return syscall(SYS_futex, word, op, value, NULL, NULL, 0);
+}
+
+/* wakes whoever sleeps on word, only entering the kernel if they have gone to sleep */
+static void ring(uint32_t *word, uint32_t *waiting)
+{
+  __atomic_add_fetch(word, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST)) {
+    futex(word, FUTEX_WAKE_PRIVATE, 1);
+  }
+}
+
+/* sleeps on word unless ready() turns true after announcing it */
+static void sleep_on(uint32_t *word, uint32_t *waiting, struct subscriber *s, int (*ready)(struct subscriber *))
+{
+  uint32_t value = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+
+  __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+  if (!ready(s)) {
+    futex(word, FUTEX_WAIT_PRIVATE, value);
+  }
+  __atomic_store_n(waiting, 0, __ATOMIC_SEQ_CST);
+}
+
+static uint64_t now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static int has_data(struct subscriber *s)
+{
+  return __atomic_load_n(&s->head, __ATOMIC_SEQ_CST) != __atomic_load_n(&s->tail, __ATOMIC_SEQ_CST);
+}
+
+static int has_space(struct subscriber *s)
+{
+  return __atomic_load_n(&s->tail, __ATOMIC_SEQ_CST) - __atomic_load_n(&s->head, __ATOMIC_SEQ_CST) < s->depth;
+}
+
+void fanout_init(struct fanout *fanout, size_t max_length, size_t depth)
+{
+  memset(fanout, 0, sizeof(*fanout));
+  fanout->max_length = max_length;
+  fanout->depth = depth;
+}
+
+static int open_subscriber(struct subscriber *s, const char *spec)
+{
+  struct endpoint endpoint;
+
+  if (!strncmp(spec, "file://", 7)) {
+    s->fd = open(spec + 7, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    return s->fd == -1 ? -1 : 0;
+  }
+  if (!strncmp(spec, "pipe://", 7)) {
+    if ((s->pipe = popen(spec + 7, "w")) == NULL) {
+      return -1;
+    }
+    s->fd = fileno(s->pipe);
+    return 0;
+  }
+  if (endpoint_parse(&endpoint, spec, SOCK_DGRAM) || endpoint_is_shm(&endpoint)) {
+    errno = EINVAL;
+    return -1;
+  }
+  /* a connected socket needs no address on every send */
+  if ((s->fd = endpoint_open(&endpoint, 0, &connect)) < 0) {
+    errno = errno ? errno : EINVAL;
+    return -1;
+  }
+  s->datagram = 1;
+  return 0;
+}
+
+/* opens the subscriber named by spec, returns -1 with errno set if it can't */
+int fanout_add(struct fanout *fanout, const char *spec, int block)
+{
+  struct subscriber *s, **subscribers;
+
+  subscribers = realloc(fanout->subscribers, (fanout->count + 1) * sizeof(*subscribers));
+  if (subscribers == NULL) {
+    return -1;
+  }
+  fanout->subscribers = subscribers;
+  if ((s = aligned_alloc(64, sizeof(*s))) == NULL) {
+    return -1;
+  }
+  memset(s, 0, sizeof(*s));
+  strncpy(s->name, spec, sizeof(s->name) - 1);
+  s->block = block;
+  s->depth = fanout->depth;
+  /* each slot is the datagram length followed by its bytes */
+  s->stride = (sizeof(size_t) + fanout->max_length + 7) & ~(size_t) 7;
+  if ((s->slots = malloc(s->depth * s->stride)) == NULL || open_subscriber(s, spec) == -1) {
+    free(s->slots);
+    free(s);
+    return -1;
+  }
+  subscribers[fanout->count++] = s;
+  return 0;
+}
+
+static int write_all(int fd, struct iovec *iov, size_t count)
+{
+  ssize_t n;
+
+  while (count) {
+    n = writev(fd, iov, count);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    while (count && (size_t) n >= iov->iov_len) {
+      n -= iov->iov_len;
+      ++iov;
+      --count;
+    }
+    if (count) {
+      iov->iov_base = (char *) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+/* copies a batch out of the queue before sending it, a dropping receiver may
+ * reuse the slots at any time and the claim on them only holds if head has
+ * not moved in the meantime
+ */
+static void *drain(void *arg)
+{
+  struct subscriber *s = arg;
+  struct mmsghdr msgs[FANOUT_BATCH];
+  struct iovec iovs[FANOUT_BATCH];
+  char *batch = malloc(FANOUT_BATCH * s->stride), *slot;
+  uint64_t head, tail;
+  size_t i, n, bytes, length, failed;
+  int sent;
+
+  if (batch == NULL) {
+    return NULL;
+  }
+  memset(msgs, 0, sizeof(msgs));
+  for (i = 0; i < FANOUT_BATCH; ++i) {
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  for (;;) {
+    head = LOAD(&s->head);
+    tail = LOAD(&s->tail);
+    if (head == tail) {
+      sleep_on(&s->doorbell, &s->waiting, s, has_data);
+      continue;
+    }
+    n = tail - head < FANOUT_BATCH ? tail - head : FANOUT_BATCH;
+    for (i = 0, bytes = 0; i < n; ++i) {
+      slot = s->slots + ((head + i) % s->depth) * s->stride;
+      /* the length may be torn by a concurrent drop, the claim below then fails */
+      memcpy(&length, slot, sizeof(size_t));
+      if (length > s->stride - sizeof(size_t)) {
+        length = s->stride - sizeof(size_t);
+      }
+      memcpy(batch + i * s->stride, slot + sizeof(size_t), length);
+      iovs[i].iov_base = batch + i * s->stride;
+      iovs[i].iov_len = length;
+      bytes += length;
+    }
+    if (!__atomic_compare_exchange_n(&s->head, &head, head + n, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      /* the receiver dropped some of them, start again from the new head */
+      continue;
+    }
+    if (s->block) {
+      ring(&s->space, &s->space_waiting);
+    }
+
+    if (s->datagram) {
+      for (i = 0, failed = 0; i < n; ) {
+        if ((sent = sendmmsg(s->fd, msgs + i, n - i, 0)) > 0) {
+          i += sent;
+          continue;
+        }
+        /* nobody is listening yet or the socket is out of buffer space, skip the one that failed */
+        __atomic_add_fetch(&s->errors, 1, __ATOMIC_RELAXED);
+        bytes -= iovs[i++].iov_len;
+        ++failed;
+      }
+      n -= failed;
+    } else if (write_all(s->fd, iovs, n) == -1) {
+      __atomic_add_fetch(&s->errors, n, __ATOMIC_RELAXED);
+      continue;
+    }
+    __atomic_add_fetch(&s->sent, n, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->bytes, bytes, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+int fanout_start(struct fanout *fanout)
+{
+  size_t i;
+
+  /* a pipe subscriber that exits shows up as EPIPE on its writes */
+  signal(SIGPIPE, SIG_IGN);
+  for (i = 0; i < fanout->count; ++i) {
+    if ((errno = pthread_create(&fanout->subscribers[i]->thread, NULL, drain, fanout->subscribers[i])) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* queues a datagram for every subscriber, they see it after fanout_publish */
+void fanout_push(struct fanout *fanout, const char *data, size_t length)
+{
+  struct subscriber *s;
+  uint64_t head, tail, now;
+  char *slot;
+  size_t i;
+
+  if (length > fanout->max_length) {
+    length = fanout->max_length;
+  }
+  for (i = 0; i < fanout->count; ++i) {
+    s = fanout->subscribers[i];
+    tail = s->tail;
+    head = LOAD(&s->head);
+    while (tail - head == s->depth) {
+      if (s->block) {
+        /* let the subscriber see what is queued so it can make room */
+        ring(&s->doorbell, &s->waiting);
+        sleep_on(&s->space, &s->space_waiting, s, has_space);
+        head = LOAD(&s->head);
+      } else {
+        /* a subscriber that is merely asleep or mid batch gets a short while
+           to catch up first, so only one that really falls behind drops */
+        ring(&s->doorbell, &s->waiting);
+        now = now_us();
+        if (!s->grace_until) {
+          s->grace_until = now + FANOUT_GRACE;
+        }
+        if (now < s->grace_until) {
+          sched_yield();
+          head = LOAD(&s->head);
+        } else if (__atomic_compare_exchange_n(&s->head, &head, head + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+          /* drop the oldest */
+          __atomic_add_fetch(&s->dropped, 1, __ATOMIC_RELAXED);
+          head = head + 1;
+        }
+      }
+    }
+    slot = s->slots + (tail % s->depth) * s->stride;
+    memcpy(slot, &length, sizeof(size_t));
+    memcpy(slot + sizeof(size_t), data, length);
+    STORE(&s->tail, tail + 1);
+    /* a big batch is published as it goes, so the subscriber drains it
+       while the rest is queued instead of only once it is all in */
+    if (tail + 1 - head >= FANOUT_PUBLISH_FILL(s->depth)) {
+      ring(&s->doorbell, &s->waiting);
+    }
+  }
+}
+
+void fanout_publish(struct fanout *fanout)
+{
+  size_t i;
+
+  for (i = 0; i < fanout->count; ++i) {
+    ring(&fanout->subscribers[i]->doorbell, &fanout->subscribers[i]->waiting);
+    fanout->subscribers[i]->grace_until = 0;
+  }
+}
+
+/* one line per subscriber with what happened since the last report */
+void fanout_report(struct fanout *fanout, FILE *out, uint64_t elapsed)
+{
+  struct subscriber *s;
+  uint64_t sent, bytes, dropped, errors;
+  size_t i;
+
+  for (i = 0; i < fanout->count && elapsed; ++i) {
+    s = fanout->subscribers[i];
+    sent = __atomic_load_n(&s->sent, __ATOMIC_RELAXED);
+    bytes = __atomic_load_n(&s->bytes, __ATOMIC_RELAXED);
+    dropped = __atomic_load_n(&s->dropped, __ATOMIC_RELAXED);
+    errors = __atomic_load_n(&s->errors, __ATOMIC_RELAXED);
+    fprintf(out, "subscriber %s: %.2f datagrams/s, %.2f MB/s, dropped %lu, errors %lu, queued %lu of %lu\n",
+        s->name, (sent - s->reported_sent) * 1000000.0 / elapsed,
+        (bytes - s->reported_bytes) * 0.9536743164 / elapsed,
+        dropped - s->reported_dropped, errors - s->reported_errors,
+        LOAD(&s->tail) - LOAD(&s->head), s->depth);
+    s->reported_sent = sent;
+    s->reported_bytes = bytes;
+    s->reported_dropped = dropped;
+    s->reported_errors = errors;
+  }
+}
@@ -0,0 +1,63 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/* relays datagrams to any number of subscribers, each with its own bounded
+ * single producer single consumer queue drained by its own thread, so a slow
+ * subscriber only ever holds up itself. subscribers are named by
+ *   udp://HOST:PORT, udp6://[HOST]:PORT, unixgram://PATH   one datagram each
+ *   file://PATH                                            appended, FIFOs too
+ *   pipe://COMMAND                                         stdin of a shell command
+ * when a queue is full a dropping subscriber loses its oldest datagram and a
+ * blocking one makes the receiver wait
+ */
+#define FANOUT_BATCH 256
+/* queued datagrams that make the receiver wake the subscriber without waiting for fanout_publish */
+/* microseconds a full dropping queue may hold up the receiver in each published batch */
+#define FANOUT_GRACE 2000
+#define FANOUT_PUBLISH_FILL(depth) ((depth) / 4 + 1)
+
+struct subscriber {
+  char name[256];
+  int fd;
+  int datagram;
+  int block;
+  FILE *pipe;
+  pthread_t thread;
+  char *slots;
+  size_t depth, stride;
+  /* the receiver moves tail, the subscriber thread moves head, and the
+     receiver moves head too when it drops the oldest datagram */
+  uint64_t head __attribute__((aligned(64)));
+  uint64_t tail __attribute__((aligned(64)));
+  /* futex words, rung by the receiver after publishing and by the
+     subscriber after freeing slots a blocked receiver waits on */
+  uint32_t doorbell __attribute__((aligned(64)));
+  uint32_t waiting;
+  uint32_t space, space_waiting;
+  /* written by the receiver */
+  uint64_t dropped __attribute__((aligned(64)));
+  uint64_t grace_until;
+  /* written by the subscriber thread */
+  uint64_t sent __attribute__((aligned(64)));
+  uint64_t bytes, errors;
+  /* last values reported */
+  uint64_t reported_sent, reported_bytes, reported_dropped, reported_errors;
+};
+
+struct fanout {
+  struct subscriber **subscribers;
+  size_t count;
+  size_t max_length, depth;
+};
+
+void fanout_init(struct fanout *fanout, size_t max_length, size_t depth);
+int fanout_add(struct fanout *fanout, const char *spec, int block);
+int fanout_start(struct fanout *fanout);
+void fanout_push(struct fanout *fanout, const char *data, size_t length);
+void fanout_publish(struct fanout *fanout);
+void fanout_report(struct fanout *fanout, FILE *out, uint64_t elapsed);
+#endif/*FANOUT_H*/
@@ -0,0 +1,119 @@
+#include <string.h>
+#include "histogram.h"
+
+static size_t bucket_index(uint64_t value)
+{
+  int shift;
+
+  if (value < (1 << HISTOGRAM_SUB_BITS)) {
+    return value;
+  }
+  if (value >> HISTOGRAM_MAX_BITS) {
+    return HISTOGRAM_BUCKETS - 1;
+  }
+  shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+  return ((shift + 1) << HISTOGRAM_SUB_BITS) + (value >> shift) - (1 << HISTOGRAM_SUB_BITS);
+}
+
+/* largest value that falls into the bucket */
+static uint64_t bucket_value(size_t index)
+{
+  int shift;
+  uint64_t mantissa;
+
+  if (index < (1 << HISTOGRAM_SUB_BITS)) {
+    return index;
+  }
+  shift = (index >> HISTOGRAM_SUB_BITS) - 1;
+  mantissa = (index & ((1 << HISTOGRAM_SUB_BITS) - 1)) + (1 << HISTOGRAM_SUB_BITS);
+  return (mantissa << shift) + ((uint64_t) 1 << shift) - 1;
+}
+
+void histogram_init(struct histogram *h)
+{
+  memset(h, 0, sizeof(*h));
+  h->min = ~(uint64_t) 0;
+}
+
+void histogram_record(struct histogram *h, uint64_t value)
+{
+  ++h->buckets[bucket_index(value)];
+  ++h->count;
+  h->sum += value;
+  if (value < h->min) {
+    h->min = value;
+  }
+  if (value > h->max) {
+    h->max = value;
+  }
+}
+
+void histogram_merge(struct histogram *h, const struct histogram *other)
+{
+  size_t i;
+
+  for (i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+    h->buckets[i] += other->buckets[i];
+  }
+  h->count += other->count;
+  h->sum += other->sum;
+  if (other->min < h->min) {
+    h->min = other->min;
+  }
+  if (other->max > h->max) {
+    h->max = other->max;
+  }
+}
+
+/* turns a running histogram into the values recorded after since was taken,
+ * min and max are only known to the bucket precision afterwards
+ */
+void histogram_delta(struct histogram *h, const struct histogram *since)
+{
+  size_t i;
+
+  h->count = 0;
+  h->min = ~(uint64_t) 0;
+  h->max = 0;
+  for (i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+    h->buckets[i] -= since->buckets[i];
+    if (h->buckets[i]) {
+      h->count += h->buckets[i];
+      if (h->min == ~(uint64_t) 0) {
+        h->min = i ? bucket_value(i - 1) + 1 : 0;
+      }
+      h->max = bucket_value(i);
+    }
+  }
+  h->sum -= since->sum;
+}
+
+/* returns the smallest recorded value that at least percentile percent of the
+ * recorded values are less than or equal to, within the bucket precision
+ */
+uint64_t histogram_percentile(const struct histogram *h, double percentile)
+{
+  uint64_t rank, seen = 0, value;
+  double exact = percentile * h->count / 100.0;
+  size_t i;
+
+  if (!h->count) {
+    return 0;
+  }
+
+  rank = (uint64_t) exact;
+  if (rank < exact) {
+    ++rank;
+  }
+  if (rank < 1) {
+    rank = 1;
+  }
+  for (i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+    seen += h->buckets[i];
+    if (seen >= rank) {
+      break;
+    }
+  }
+  value = bucket_value(i < HISTOGRAM_BUCKETS ? i : HISTOGRAM_BUCKETS - 1);
+  return value < h->min ? h->min : value > h->max ? h->max : value;
+}
@@ -0,0 +1,23 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+#include <stdint.h>
+
+/* log-linear buckets, values below 2^HISTOGRAM_SUB_BITS are exact and larger
+ * values keep HISTOGRAM_SUB_BITS bits of precision (about 3% error), values
+ * past 2^HISTOGRAM_MAX_BITS are counted in the last bucket
+ */
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+struct histogram {
+  uint64_t count, sum, min, max;
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+void histogram_init(struct histogram *h);
+void histogram_record(struct histogram *h, uint64_t value);
+void histogram_merge(struct histogram *h, const struct histogram *other);
+void histogram_delta(struct histogram *h, const struct histogram *since);
+uint64_t histogram_percentile(const struct histogram *h, double percentile);
+#endif/*HISTOGRAM_H*/
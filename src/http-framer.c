@@ -0,0 +1,144 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "http-framer.h"
+
+void http_framer_init(struct http_framer *framer)
+{
+  memset(framer, 0, sizeof(*framer));
+  framer->state = HTTP_STATUS_LINE;
+}
+
+/* moves on once the headers are done, returns 1 if that ends the response */
+static int end_of_headers(struct http_framer *framer)
+{
+  if (framer->status / 100 == 1 && framer->status != 101) {
+    /* interim response, the real one follows */
+    framer->state = HTTP_STATUS_LINE;
+    return 0;
+  }
+  if (framer->status == 204 || framer->status == 304) {
+    return 1;
+  }
+  if (framer->chunked) {
+    framer->state = HTTP_CHUNK_SIZE;
+    return 0;
+  }
+  if (framer->content_length >= 0) {
+    framer->remaining = framer->content_length;
+    framer->state = HTTP_BODY;
+    return framer->remaining == 0;
+  }
+  framer->state = HTTP_UNTIL_CLOSE;
+  return 0;
+}
+
+/* handles one complete line, returns 1 at the end of a response and -1 if malformed */
+static int parse_line(struct http_framer *framer)
+{
+  char *line = framer->line, *end;
+  size_t i, length = framer->line_length;
+
+  while (length && (line[length - 1] == '\r' || line[length - 1] == '\n')) {
+    --length;
+  }
+  line[length < HTTP_FRAMER_LINE ? length : HTTP_FRAMER_LINE - 1] = 0;
+  framer->line_length = 0;
+
+  switch (framer->state) {
+  case HTTP_STATUS_LINE:
+    if (!length) {
+      return 0;
+    }
+    if (strncmp(line, "HTTP/1.", 7) || length < 12 || !isdigit((unsigned char) line[9])) {
+      return -1;
+    }
+    framer->status = atoi(line + 9);
+    framer->chunked = 0;
+    framer->content_length = -1;
+    framer->state = HTTP_HEADERS;
+    return 0;
+  case HTTP_HEADERS:
+    if (!length) {
+      return end_of_headers(framer);
+    }
+    if (!strncasecmp(line, "content-length:", 15)) {
+      framer->content_length = strtoll(line + 15, NULL, 10);
+    } else if (!strncasecmp(line, "transfer-encoding:", 18)) {
+      for (i = 18; line[i]; ++i) {
+        line[i] = tolower((unsigned char) line[i]);
+      }
+      framer->chunked = strstr(line + 18, "chunked") != NULL;
+    }
+    return 0;
+  case HTTP_CHUNK_SIZE:
+    framer->remaining = strtoull(line, &end, 16);
+    if (end == line) {
+      return -1;
+    }
+    framer->state = framer->remaining ? HTTP_CHUNK_DATA : HTTP_TRAILERS;
+    return 0;
+  case HTTP_CHUNK_END:
+    framer->state = HTTP_CHUNK_SIZE;
+    return 0;
+  case HTTP_TRAILERS:
+    return length == 0;
+  default:
+    return -1;
+  }
+}
+
+/* consumes data up to the end of at most one response and returns how much
+ * was used, *status is set to the status code when a response completes
+ */
+ssize_t http_framer_feed(struct http_framer *framer, const char *data, size_t length, int *status)
+{
+  const char *newline;
+  size_t used, keep;
+  int done;
+
+  *status = 0;
+  switch (framer->state) {
+  case HTTP_BODY:
+  case HTTP_CHUNK_DATA:
+    used = length < framer->remaining ? length : framer->remaining;
+    framer->remaining -= used;
+    if (framer->remaining) {
+      return used;
+    }
+    if (framer->state == HTTP_CHUNK_DATA) {
+      framer->state = HTTP_CHUNK_END;
+      return used;
+    }
+    *status = framer->status;
+    framer->state = HTTP_STATUS_LINE;
+    return used;
+  case HTTP_UNTIL_CLOSE:
+    return length;
+  default:
+    newline = memchr(data, '\n', length);
+    used = newline ? (size_t) (newline - data) + 1 : length;
+    keep = framer->line_length < HTTP_FRAMER_LINE ? HTTP_FRAMER_LINE - framer->line_length : 0;
+    memcpy(framer->line + framer->line_length, data, used < keep ? used : keep);
+    framer->line_length += used < keep ? used : keep;
+    if (!newline) {
+      return used;
+    }
+    done = parse_line(framer);
+    if (done < 0) {
+      return -1;
+    }
+    if (done) {
+      *status = framer->status;
+      framer->state = HTTP_STATUS_LINE;
+    }
+    return used;
+  }
+}
+
+/* a response without a length ends when the connection does, returns its status */
+int http_framer_closed(struct http_framer *framer)
+{
+  return framer->state == HTTP_UNTIL_CLOSE ? framer->status : 0;
+}
@@ -0,0 +1,36 @@
+#ifndef HTTP_FRAMER_H
+#define HTTP_FRAMER_H
+#include <stdint.h>
+#include <sys/types.h>
+
+/* only the start of each line is kept, which is all the status line,
+ * Content-Length and Transfer-Encoding need
+ */
+#define HTTP_FRAMER_LINE 64
+
+enum http_framer_state {
+  HTTP_STATUS_LINE,
+  HTTP_HEADERS,
+  HTTP_BODY,
+  HTTP_CHUNK_SIZE,
+  HTTP_CHUNK_DATA,
+  HTTP_CHUNK_END,
+  HTTP_TRAILERS,
+  HTTP_UNTIL_CLOSE
+};
+
+/* incremental HTTP/1.1 response framing, fed straight from the socket reads */
+struct http_framer {
+  enum http_framer_state state;
+  int status;
+  int chunked;
+  int64_t content_length;
+  uint64_t remaining;
+  size_t line_length;
+  char line[HTTP_FRAMER_LINE];
+};
+
+void http_framer_init(struct http_framer *framer);
+ssize_t http_framer_feed(struct http_framer *framer, const char *data, size_t length, int *status);
+int http_framer_closed(struct http_framer *framer);
+#endif/*HTTP_FRAMER_H*/
@@ -1,94 +1,525 @@
+#define _GNU_SOURCE
 #define MAIN
 
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
-#define ALIGN(s, a) (((s) + (a) - 1) & ~(a - 1))
+/* bytes asked of copy_file_range at once */
+#define RANGE_CHUNK (1 << 30)
+#define DEFAULT_CHUNK (64 << 20)
 
-int
-main(int argc, char *argv[]) {
-  char const * src;
-  char path[PATH_MAX + 1], *dst;
-  int n, fd;
-  size_t i, d = argc - 1;
-  struct stat src_st, dst_st;
+/* a file bigger than the chunk size is copied as several tasks at chunk
+   aligned offsets, smaller ones are a single task that also opens and
+   creates the destination */
+struct file {
+  const char *source;
+  char path[PATH_MAX + 1];
   off_t size;
+  mode_t mode;
+  size_t chunks, left;
+  /* bytes in the data extents of the source */
+  off_t data;
+  /* the first strategy worth trying and the slowest one that was needed,
+     -1 while no range has been copied */
+  int first, used;
+  uint64_t start;
+};
 
-  if (argc < 3) {
-    fprintf(stderr, "%s [SOURCE] [DIRECTORY]\n", argv[0]);
-    return 0;
+struct task {
+  struct file *file;
+  off_t offset, length;
+};
+
+static struct task *tasks;
+static size_t task_count, task_max, next_task;
+static int failed;
+static long page_size;
+/* bytes the mmap path maps at once when streaming, 0 maps a whole task */
+static off_t window;
+/* whether the mmap path leaves pages of zeros as holes, and how many it left */
+static int zeros;
+static off_t zeros_skipped;
+/* whether existing destinations are compared and only the pages that differ written */
+static int delta;
+static off_t delta_compared, delta_written;
+
+/* GCC vector extension, 32 bytes is a single AVX2 register or a pair of SSE2 ones */
+typedef uint64_t block_vector __attribute__((vector_size(32)));
+
+static uint64_t
+nanoseconds(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* shares the source extents on filesystems with reflinks, btrfs and xfs */
+static int
+copy_clone(int in, int out, off_t offset, off_t length) {
+  struct file_clone_range range;
+
+  range.src_fd = in;
+  range.src_offset = offset;
+  range.src_length = length;
+  range.dest_offset = offset;
+  return ioctl(out, FICLONERANGE, &range);
+}
+
+/* lets the kernel copy, offloaded to the filesystem or the storage where it can be */
+static int
+copy_range(int in, int out, off_t offset, off_t length) {
+  loff_t off_in = offset, off_out = offset;
+  off_t end = offset + length;
+  ssize_t n;
+
+  while (off_in < end) {
+    n = copy_file_range(in, &off_in, out, &off_out, end - off_in < RANGE_CHUNK ? end - off_in : RANGE_CHUNK, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      /* the next strategy copies the whole range again */
+      if (n == 0) {
+        errno = EIO;
+      }
+      return -1;
+    }
   }
+  return 0;
+}
 
-  for (i = 1; i < d; ++i) {
-    n = snprintf(path, PATH_MAX, "%s/%s", argv[d], basename(argv[i]));
-    if (n >= PATH_MAX) {
-      fprintf(stderr, "Name too long: '%s/%s'\n", argv[d], basename(argv[i]));
-      return 1;
+/* n is a multiple of 128 and p is aligned to 32 bytes */
+static int
+is_zero(const char *p, size_t n) {
+  const block_vector *v = (const block_vector *) p, *end = v + n / sizeof(*v);
+  block_vector any = { 0, 0, 0, 0 };
+
+  for (; v < end; v += 4) {
+    any |= v[0] | v[1] | v[2] | v[3];
+  }
+  return !(any[0] | any[1] | any[2] | any[3]);
+}
+
+/* n is a multiple of 128 and both are aligned to 32 bytes */
+static int
+is_same(const char *a, const char *b, size_t n) {
+  const block_vector *v = (const block_vector *) a, *w = (const block_vector *) b, *end = v + n / sizeof(*v);
+  block_vector any = { 0, 0, 0, 0 };
+
+  for (; v < end; v += 4, w += 4) {
+    any |= (v[0] ^ w[0]) | (v[1] ^ w[1]) | (v[2] ^ w[2]) | (v[3] ^ w[3]);
+  }
+  return !(any[0] | any[1] | any[2] | any[3]);
+}
+
+/* only the pages of the existing destination that differ are written, and so dirtied */
+static void
+copy_changed(char *dst, char const * src, off_t start, off_t offset, off_t end) {
+  off_t next, written = 0, compared = end - offset;
+
+  for (; offset < end; offset = next) {
+    next = (offset & ~(off_t) (page_size - 1)) + page_size;
+    next = next < end ? next : end;
+    if (next - offset == page_size ? !is_same(dst + (offset - start), src + (offset - start), page_size) :
+        memcmp(dst + (offset - start), src + (offset - start), next - offset) != 0) {
+      memcpy(dst + (offset - start), src + (offset - start), next - offset);
+      written += next - offset;
     }
+  }
+  __atomic_add_fetch(&delta_compared, compared, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&delta_written, written, __ATOMIC_RELAXED);
+}
 
-    fd = open(argv[i], O_RDONLY);
-    if (fd < 0) {
-      fprintf(stderr, "Failed to copy '%s' to '%s'\n", argv[i], path);
-      perror("Could not open source");
-      return 1;
+/* the destination is new, so leaving whole pages of zeros unwritten keeps
+   them holes. pages partly outside the range are always copied */
+static void
+copy_nonzero(char *dst, char const * src, off_t start, off_t offset, off_t end) {
+  off_t run = offset, next, skipped = 0;
+
+  for (; offset < end; offset = next) {
+    next = (offset & ~(off_t) (page_size - 1)) + page_size;
+    next = next < end ? next : end;
+    if (next - offset == page_size && is_zero(src + (offset - start), page_size)) {
+      memcpy(dst + (run - start), src + (run - start), offset - run);
+      run = next;
+      skipped += page_size;
     }
+  }
+  memcpy(dst + (run - start), src + (run - start), end - run);
+  __atomic_add_fetch(&zeros_skipped, skipped, __ATOMIC_RELAXED);
+}
 
-    n = fstat(fd, &src_st);
-    if (n) {
-      fprintf(stderr, "Failed to copy '%s' to '%s'\n", argv[i], path);
-      perror("failed to stat source file.");
-      return 1;
+/* the destination is already as long as the source, so both are mapped
+   from the page the range starts in */
+static int
+copy_window(int in, int out, off_t offset, off_t length) {
+  char const * src;
+  char *dst;
+  off_t start = offset & ~(off_t) (page_size - 1);
+  size_t mapped = length + (offset - start);
+
+  src = mmap(NULL, mapped, PROT_READ, MAP_PRIVATE, in, start);
+  if (src == MAP_FAILED) {
+    perror("Could not map source");
+    return -1;
+  }
+  dst = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, out, start);
+  if (dst == MAP_FAILED) {
+    perror("Could not map destination");
+    munmap((void*) src, mapped);
+    return -1;
+  }
+  if (window) {
+    madvise((void*) src, mapped, MADV_SEQUENTIAL);
+    madvise((void*) src, mapped, MADV_WILLNEED);
+  }
+  if (delta) {
+    copy_changed(dst, src, start, offset, offset + length);
+  } else if (zeros) {
+    copy_nonzero(dst, src, start, offset, offset + length);
+  } else {
+    memcpy(dst + (offset - start), src + (offset - start), length);
+  }
+  munmap((void*) src, mapped);
+  munmap(dst, mapped);
+  return 0;
+}
+
+/* writes back a window that is done and drops it from the page cache */
+static void
+release_window(int in, int out, off_t offset, off_t length) {
+  sync_file_range(out, offset, length, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+  posix_fadvise(out, offset, length, POSIX_FADV_DONTNEED);
+  posix_fadvise(in, offset, length, POSIX_FADV_DONTNEED);
+}
+
+/* streams through the range a window at a time, reading the next window
+ * ahead while the current one is copied, starting writeback as soon as a
+ * window is copied and releasing it once the next one is, so the page
+ * cache the copy holds stays around two windows whatever the file size
+ */
+static int
+copy_mmap(int in, int out, off_t offset, off_t length) {
+  off_t end = offset + length, step, previous = -1, previous_length = 0;
+
+  if (!window) {
+    return length ? copy_window(in, out, offset, length) : 0;
+  }
+  for (; offset < end; offset += step) {
+    step = end - offset < window ? end - offset : window;
+    if (offset + step < end) {
+      posix_fadvise(in, offset + step, end - offset - step < window ? end - offset - step : window, POSIX_FADV_WILLNEED);
+    }
+    if (copy_window(in, out, offset, step) == -1) {
+      return -1;
+    }
+    sync_file_range(out, offset, step, SYNC_FILE_RANGE_WRITE);
+    if (previous >= 0) {
+      release_window(in, out, previous, previous_length);
+    }
+    previous = offset;
+    previous_length = step;
+  }
+  if (previous >= 0) {
+    release_window(in, out, previous, previous_length);
+  }
+  return 0;
+}
+
+static const struct strategy {
+  const char *name;
+  int (*copy)(int in, int out, off_t offset, off_t length);
+} strategies[] = {
+  { "clone", copy_clone },
+  { "copy_file_range", copy_range },
+  { "mmap", copy_mmap },
+};
+
+#define STRATEGIES ((int) (sizeof(strategies) / sizeof(strategies[0])))
+
+static int
+open_destination(struct file *file, int flags) {
+  int out;
+
+  /* in delta mode the destination is kept and only resized */
+  out = open(file->path, O_RDWR | (delta ? flags & ~O_TRUNC : flags), file->mode);
+
+  if (out < 0) {
+    perror("Could not open destination");
+    return -1;
+  }
+  if ((flags & O_CREAT) && ftruncate(out, file->size) < 0) {
+    perror("Could not truncate destination");
+    close(out);
+    return -1;
+  }
+  return out;
+}
+
+/* copies only the data extents in the range, the holes are left as holes in
+   the new destination. a filesystem without SEEK_DATA is all data, and so
+   is everything in delta mode, where a hole may have to clear old data */
+static int
+copy_extents(const struct strategy *strategy, int in, int out, off_t offset, off_t length, off_t *data) {
+  off_t end = offset + length, start, stop;
+
+  *data = 0;
+  if (delta) {
+    *data = length;
+    return strategy->copy(in, out, offset, length);
+  }
+  while (offset < end) {
+    start = lseek(in, offset, SEEK_DATA);
+    if (start == -1 && errno == ENXIO) {
+      /* nothing but a hole up to the end of the file */
+      break;
+    }
+    if (start == -1) {
+      start = offset;
+      stop = end;
+    } else if (start >= end) {
+      break;
+    } else if ((stop = lseek(in, start, SEEK_HOLE)) == -1 || stop > end) {
+      stop = end;
     }
+    if (strategy->copy(in, out, start, stop - start) == -1) {
+      return -1;
+    }
+    *data += stop - start;
+    offset = stop;
+  }
+  return 0;
+}
 
+/* tries each strategy in turn on the range, a strategy that fails is not
+   tried again on the rest of the file */
+static int
+copy_task(struct task *task) {
+  struct file *file = task->file;
+  int in, out, s, first, used;
+  off_t data = 0;
 
-    src = mmap(NULL, src_st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (src == MAP_FAILED) {
-      fprintf(stderr, "Failed to copy '%s' to '%s'\n", argv[i], path);
-      perror("Could not map source");
+  in = open(file->source, O_RDONLY);
+  if (in < 0) {
+    perror("Could not open source");
+    return -1;
+  }
+  /* a file in a single task has not been created yet */
+  out = open_destination(file, file->chunks == 1 ? O_CREAT | O_TRUNC : 0);
+  if (out < 0) {
+    close(in);
+    return -1;
+  }
+  for (s = __atomic_load_n(&file->first, __ATOMIC_RELAXED); s < STRATEGIES; ++s) {
+    if (copy_extents(&strategies[s], in, out, task->offset, task->length, &data) == 0) {
+      break;
     }
-    close(fd);
+    first = file->first;
+    while (first <= s && !__atomic_compare_exchange_n(&file->first, &first, s + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+  }
+  close(in);
+  close(out);
+  if (s == STRATEGIES) {
+    return -1;
+  }
+  __atomic_add_fetch(&file->data, data, __ATOMIC_RELAXED);
+  if (!data) {
+    /* empty or all holes, no strategy copied anything */
+    return 0;
+  }
+  used = file->used;
+  while (used < s && !__atomic_compare_exchange_n(&file->used, &used, s, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+  return 0;
+}
 
-    fd = open(path, O_RDWR | O_CREAT, src_st.st_mode);
-    if (n < 0) {
-      fprintf(stderr, "Failed to copy '%s' to '%s'\n", argv[i], path);
-      perror("Could not open destination");
-      return 1;
+static void
+report_file(struct file *file) {
+  double elapsed = (nanoseconds() - file->start) / 1e9;
+
+  printf("'%s' -> '%s': %s, %ld bytes, %ld of them data, in %.6fs, %.2f MB/s\n", file->source, file->path,
+      file->used < 0 ? "none" : strategies[file->used].name, (long) file->size, (long) file->data, elapsed, elapsed > 0 ? file->size / elapsed / 1e6 : 0.0);
+}
+
+static void *
+worker(void *arg) {
+  struct task *task;
+  uint64_t zero;
+  size_t t;
+
+  while (!__atomic_load_n(&failed, __ATOMIC_RELAXED) &&
+      (t = __atomic_fetch_add(&next_task, 1, __ATOMIC_RELAXED)) < task_count) {
+    task = &tasks[t];
+    zero = 0;
+    __atomic_compare_exchange_n(&task->file->start, &zero, nanoseconds(), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    if (copy_task(task) == -1) {
+      fprintf(stderr, "Failed to copy '%s' to '%s'\n", task->file->source, task->file->path);
+      __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+      break;
+    }
+    if (__atomic_sub_fetch(&task->file->left, 1, __ATOMIC_ACQ_REL) == 0) {
+      report_file(task->file);
     }
+  }
+  return NULL;
+}
 
-    n = fstat(fd, &dst_st);
-    if (n) {
-      fprintf(stderr, "Failed to copy '%s' to '%s'\n", argv[i], path);
-      perror("failed to stat destination file.");
-      return 1;
+/* stats a source and splits it into tasks, creating the destination if it is split */
+static int
+plan(struct file *file, const char *source, const char *directory, off_t chunk) {
+  struct stat src_st;
+  struct task *grown;
+  off_t offset;
+  int n, out;
+
+  file->source = source;
+  n = snprintf(file->path, PATH_MAX, "%s/%s", directory, basename((char *) source));
+  if (n >= PATH_MAX) {
+    fprintf(stderr, "Name too long: '%s/%s'\n", directory, basename((char *) source));
+    return -1;
+  }
+  if (stat(source, &src_st)) {
+    fprintf(stderr, "Failed to copy '%s' to '%s'\n", source, file->path);
+    perror("failed to stat source file.");
+    return -1;
+  }
+  file->size = src_st.st_size;
+  file->mode = src_st.st_mode;
+  /* only the mmap path sees the bytes to find the zeros or the changes */
+  file->first = zeros || delta ? STRATEGIES - 1 : 0;
+  file->used = -1;
+  file->chunks = file->left = file->size > chunk ? (file->size + chunk - 1) / chunk : 1;
+  if (task_count + file->chunks > task_max) {
+    task_max = (task_count + file->chunks) * 2;
+    if ((grown = realloc(tasks, task_max * sizeof(*tasks))) == NULL) {
+      perror("Could not allocate");
+      return -1;
+    }
+    tasks = grown;
+  }
+  if (file->chunks > 1) {
+    if ((out = open_destination(file, O_CREAT | O_TRUNC)) < 0) {
+      fprintf(stderr, "Failed to copy '%s' to '%s'\n", source, file->path);
+      return -1;
     }
+    close(out);
+  }
+  for (offset = 0; offset == 0 || offset < file->size; offset += chunk) {
+    tasks[task_count].file = file;
+    tasks[task_count].offset = offset;
+    tasks[task_count++].length = file->size - offset < chunk ? file->size - offset : chunk;
+  }
+  return 0;
+}
 
-    size = ALIGN(src_st.st_size, dst_st.st_blksize);
-    n = ftruncate(fd, size);
-    if (n < 0) {
-      fprintf(stderr, "Failed to copy '%s' to '%s'\n", argv[i], path);
-      perror("Could not truncate destination");
+static void
+usage(const char *progname) {
+  fprintf(stderr, "%s [-j WORKERS] [-c CHUNK] [-w WINDOW] [-dz] [SOURCE] [DIRECTORY]\n"
+      "  -j=CPUS     : Files or chunks copied at once\n"
+      "  -c=%d : Files bigger than this many bytes are copied in chunks of it in parallel\n"
+      "  -w=0        : Stream mmap copies through windows of this many bytes, dropping them from the page cache once copied\n"
+      "  -d          : Compare with existing destinations and write only the pages that differ, this copies with mmap\n"
+      "  -z          : Leave pages of zeros as holes, this copies with mmap\n",
+      progname, DEFAULT_CHUNK);
+}
+
+int
+main(int argc, char *argv[]) {
+  struct file *files;
+  pthread_t *threads;
+  long workers = sysconf(_SC_NPROCESSORS_ONLN);
+  off_t chunk = DEFAULT_CHUNK, bytes = 0;
+  size_t i, count;
+  uint64_t start;
+  double elapsed;
+  int ch;
+
+  while ((ch = getopt(argc, argv, "c:dj:w:z")) != -1) {
+    switch(ch) {
+    case 'c':
+      chunk = atoll(optarg);
+      break;
+    case 'd':
+      delta = 1;
+      break;
+    case 'j':
+      workers = atol(optarg);
+      break;
+    case 'w':
+      window = atoll(optarg);
+      break;
+    case 'z':
+      zeros = 1;
+      break;
+    default:
+      usage(argv[0]);
       return 1;
     }
+  }
+  argc -= optind;
+  argv += optind;
 
-    dst = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (dst == MAP_FAILED) {
-      fprintf(stderr, "Failed to copy '%s' to '%s'\n", argv[i], path);
-      perror("Could not map destination");
+  if (argc < 2) {
+    usage(argv[-optind]);
+    return 0;
+  }
+  page_size = sysconf(_SC_PAGESIZE);
+  /* chunks start on page boundaries, for the mmap path and block aligned I/O */
+  chunk = chunk < page_size ? page_size : chunk & ~(off_t) (page_size - 1);
+  workers = workers < 1 ? 1 : workers;
+  window = window > 0 && window < page_size ? page_size : window & ~(off_t) (page_size - 1);
+
+  count = argc - 1;
+  files = calloc(count, sizeof(*files));
+  threads = calloc(workers, sizeof(*threads));
+  if (!files || !threads) {
+    perror("Could not allocate");
+    return 1;
+  }
+  for (i = 0; i < count; ++i) {
+    if (plan(&files[i], argv[i], argv[count], chunk) == -1) {
       return 1;
     }
-    close(fd);
-
-    memcpy(dst, src, src_st.st_size);
-    munmap((void*) src, src_st.st_size);
-    munmap(dst, src_st.st_size);
+    bytes += files[i].size;
+  }
 
+  start = nanoseconds();
+  for (i = 0; i < (size_t) workers; ++i) {
+    if ((errno = pthread_create(&threads[i], NULL, worker, NULL)) != 0) {
+      perror("Could not start worker");
+      return 1;
+    }
+  }
+  for (i = 0; i < (size_t) workers; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  if (failed) {
+    return 1;
+  }
+  elapsed = (nanoseconds() - start) / 1e9;
+  printf("%lu files, %ld bytes in %.6fs, %.2f MB/s with %ld workers", count, (long) bytes, elapsed,
+      elapsed > 0 ? bytes / elapsed / 1e6 : 0.0, workers);
+  if (delta) {
+    printf(", %ld bytes compared, %ld written", (long) delta_compared, (long) delta_written);
+  } else if (zeros) {
+    printf(", %ld bytes of zeros left as holes", (long) zeros_skipped);
   }
+  printf("\n");
+  return 0;
 }
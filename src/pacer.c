@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/timerfd.h>
+#include "pacer.h"
+
+/* interval and spin are given in microseconds */
+int pacer_init(struct pacer *pacer, uint64_t interval, uint64_t spin)
+{
+  memset(pacer, 0, sizeof(*pacer));
+  pacer->interval = interval * 1000;
+  pacer->spin = spin * 1000;
+  histogram_init(&pacer->error);
+
+  /* the default 50us timer slack would swamp the schedule */
+  if (prctl(PR_SET_TIMERSLACK, 1UL) == -1) {
+    fprintf(stderr, "Error setting timer slack - continuing\n");
+  }
+
+  pacer->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if (pacer->timerfd == -1) {
+    return -1;
+  }
+  pacer->next = nanoseconds();
+  return pacer->timerfd;
+}
+
+void pacer_close(struct pacer *pacer)
+{
+  close(pacer->timerfd);
+}
+
+/* arms the timer to fire when the spin window before the next deadline opens */
+int pacer_arm(struct pacer *pacer)
+{
+  struct itimerspec its;
+  uint64_t when = pacer->next > pacer->spin ? pacer->next - pacer->spin : 1;
+
+  if (pacer->armed == when) {
+    return 0;
+  }
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = when / 1000000000UL;
+  its.it_value.tv_nsec = when % 1000000000UL;
+  pacer->armed = when;
+  return timerfd_settime(pacer->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* true once the spin window before the next deadline has opened */
+int pacer_ready(struct pacer *pacer)
+{
+  return nanoseconds() + pacer->spin >= pacer->next;
+}
+
+/* drains a timer expiration after select reports the timerfd readable */
+void pacer_clear(struct pacer *pacer)
+{
+  uint64_t expirations;
+  read(pacer->timerfd, &expirations, sizeof(expirations));
+}
+
+void pacer_wait(struct pacer *pacer)
+{
+  while (nanoseconds() < pacer->next) ;
+}
+
+/* records how late the send was against its schedule and moves to the next slot */
+void pacer_sent(struct pacer *pacer)
+{
+  uint64_t now = nanoseconds();
+  histogram_record(&pacer->error, now > pacer->next ? now - pacer->next : 0);
+  pacer->next += pacer->interval;
+}
+
+void log_pacer(FILE *logfile, int loglevel, struct pacer *pacer)
+{
+  struct histogram *h = &pacer->error;
+  LOGF(logfile, loglevel, "pacing error over %lu requests in ns: p50 %lu p90 %lu p99 %lu p99.9 %lu max %lu\n",
+      h->count,
+      histogram_percentile(h, 50),
+      histogram_percentile(h, 90),
+      histogram_percentile(h, 99),
+      histogram_percentile(h, 99.9),
+      h->max);
+}
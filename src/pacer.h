@@ -0,0 +1,24 @@
+#ifndef PACER_H
+#define PACER_H
+#include <stdio.h>
+#include "histogram.h"
+#include "traffic-shared.h"
+
+/* sends on a fixed schedule, sleeping on a timerfd until spin nanoseconds
+ * before each deadline and then spinning until the deadline itself
+ */
+struct pacer {
+  uint64_t interval, spin, next, armed;
+  int timerfd;
+  struct histogram error;
+};
+
+int pacer_init(struct pacer *pacer, uint64_t interval, uint64_t spin);
+void pacer_close(struct pacer *pacer);
+int pacer_arm(struct pacer *pacer);
+int pacer_ready(struct pacer *pacer);
+void pacer_clear(struct pacer *pacer);
+void pacer_wait(struct pacer *pacer);
+void pacer_sent(struct pacer *pacer);
+void log_pacer(FILE *log, int loglevel, struct pacer *pacer);
+#endif/*PACER_H*/
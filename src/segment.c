@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "segment.h"
+
+static int write_all(int fd, const char *data, size_t length, off_t offset)
+{
+  ssize_t n;
+
+  while (length) {
+    if ((n = pwrite(fd, data, length, offset)) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    data += n;
+    length -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+/* opens the next unused segment number, so an earlier run is never overwritten */
+static int open_next(struct segment_sink *sink, uint64_t now)
+{
+  char path[PATH_MAX];
+  int flags = O_WRONLY | O_CREAT | O_EXCL | (sink->direct ? O_DIRECT : 0);
+
+  do {
+    snprintf(path, sizeof(path), "%s.%06u", sink->prefix, ++sink->number);
+    sink->fd = open(path, flags, 0644);
+  } while (sink->fd == -1 && errno == EEXIST);
+  if (sink->fd == -1) {
+    return -1;
+  }
+  /* the blocks are reserved up front but the file only grows as it is written */
+  if (fallocate(sink->fd, FALLOC_FL_KEEP_SIZE, 0, sink->size) == -1 && errno != EOPNOTSUPP) {
+    close(sink->fd);
+    return -1;
+  }
+  snprintf(path, sizeof(path), "%s.%06u.idx", sink->prefix, sink->number);
+  if ((sink->index_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+    close(sink->fd);
+    return -1;
+  }
+  sink->opened = now;
+  sink->length = 0;
+  sink->buffer_offset = 0;
+  sink->written = 0;
+  sink->indexed = 0;
+  sink->index_count = 0;
+  return 0;
+}
+
+int segment_open(struct segment_sink *sink, const char *prefix, size_t size, uint64_t max_age, int direct)
+{
+  memset(sink, 0, sizeof(*sink));
+  if (strlen(prefix) >= sizeof(sink->prefix)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(sink->prefix, prefix);
+  sink->size = size;
+  sink->max_age = max_age;
+  sink->direct = direct;
+  sink->fd = sink->index_fd = -1;
+  if (posix_memalign((void **) &sink->buffer, SEGMENT_ALIGN, SEGMENT_BUFFER)) {
+    errno = ENOMEM;
+    return -1;
+  }
+  return 0;
+}
+
+/* writes out what is buffered and the pending index records. with O_DIRECT
+   the last partial block goes out padded and is kept to be written again */
+int segment_flush(struct segment_sink *sink)
+{
+  size_t length = sink->length, keep = 0;
+
+  if (sink->fd == -1) {
+    return 0;
+  }
+  if (sink->direct && length % SEGMENT_ALIGN) {
+    keep = length % SEGMENT_ALIGN;
+    length += SEGMENT_ALIGN - keep;
+    memset(sink->buffer + sink->length, 0, length - sink->length);
+  }
+  if (length && write_all(sink->fd, sink->buffer, length, sink->buffer_offset) == -1) {
+    return -1;
+  }
+  if (keep) {
+    memmove(sink->buffer, sink->buffer + sink->length - keep, keep);
+  }
+  sink->buffer_offset += sink->length - keep;
+  sink->length = keep;
+  if (sink->index_count && write(sink->index_fd, sink->index, sink->index_count * sizeof(*sink->index)) == -1) {
+    return -1;
+  }
+  sink->index_count = 0;
+  return 0;
+}
+
+/* finishes the current segment, giving back the preallocated space it did not use */
+int segment_close(struct segment_sink *sink)
+{
+  int result;
+
+  if (sink->fd == -1) {
+    return 0;
+  }
+  result = segment_flush(sink);
+  if (ftruncate(sink->fd, sink->written) == -1) {
+    result = -1;
+  }
+  close(sink->fd);
+  close(sink->index_fd);
+  sink->fd = sink->index_fd = -1;
+  return result;
+}
+
+int segment_append(struct segment_sink *sink, const char *data, size_t length, uint64_t now)
+{
+  size_t n;
+
+  if (sink->fd != -1 && sink->written &&
+      (sink->written + length > sink->size || (sink->max_age && now - sink->opened >= sink->max_age))) {
+    if (segment_close(sink) == -1) {
+      return -1;
+    }
+  }
+  if (sink->fd == -1 && open_next(sink, now) == -1) {
+    return -1;
+  }
+  if (!sink->written || sink->written - sink->indexed >= SEGMENT_INDEX_STRIDE) {
+    if (sink->index_count == SEGMENT_INDEX_PENDING && segment_flush(sink) == -1) {
+      return -1;
+    }
+    sink->index[sink->index_count].offset = sink->written;
+    sink->index[sink->index_count].seq = sink->seq;
+    sink->index[sink->index_count++].time = now;
+    sink->indexed = sink->written;
+  }
+  sink->written += length;
+  ++sink->seq;
+  while (length) {
+    n = SEGMENT_BUFFER - sink->length < length ? SEGMENT_BUFFER - sink->length : length;
+    memcpy(sink->buffer + sink->length, data, n);
+    sink->length += n;
+    data += n;
+    length -= n;
+    if (sink->length == SEGMENT_BUFFER) {
+      /* a whole buffer is always aligned */
+      if (write_all(sink->fd, sink->buffer, SEGMENT_BUFFER, sink->buffer_offset) == -1) {
+        return -1;
+      }
+      sink->buffer_offset += SEGMENT_BUFFER;
+      sink->length = 0;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,49 @@
+#ifndef SEGMENT_H
+#define SEGMENT_H
+#include <limits.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* a log written as numbered segment files PREFIX.000001, PREFIX.000002 and
+ * so on, each preallocated to its full size when opened and rotated once it
+ * is full or old. records are copied into one large aligned buffer that is
+ * written a buffer at a time, which O_DIRECT needs as well. next to every
+ * segment PREFIX.000001.idx holds a struct segment_index, in native byte
+ * order, for the first record at or after every SEGMENT_INDEX_STRIDE bytes,
+ * so a reader can seek to a sequence number or time without scanning
+ */
+#define SEGMENT_ALIGN 4096
+#define SEGMENT_BUFFER (1 << 20)
+#define SEGMENT_INDEX_STRIDE 65536
+#define SEGMENT_INDEX_PENDING 64
+
+struct segment_index {
+  uint64_t offset;
+  uint64_t seq;
+  uint64_t time;
+};
+
+struct segment_sink {
+  char prefix[PATH_MAX - 32];
+  size_t size;
+  uint64_t max_age;
+  int direct;
+  int fd, index_fd;
+  unsigned int number;
+  uint64_t opened;
+  /* buffer holds the bytes from file offset buffer_offset on */
+  char *buffer;
+  size_t length;
+  uint64_t buffer_offset;
+  uint64_t written, indexed;
+  struct segment_index index[SEGMENT_INDEX_PENDING];
+  size_t index_count;
+  /* records written over all segments */
+  uint64_t seq;
+};
+
+int segment_open(struct segment_sink *sink, const char *prefix, size_t size, uint64_t max_age, int direct);
+int segment_append(struct segment_sink *sink, const char *data, size_t length, uint64_t now);
+int segment_flush(struct segment_sink *sink);
+int segment_close(struct segment_sink *sink);
+#endif/*SEGMENT_H*/
@@ -0,0 +1,255 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "shm-ring.h"
+#include "traffic-shared.h"
+
+#define SHM_MAGIC 0x72696e67
+#define SHM_LISTENING 1
+#define SHM_CONNECTED 2
+/* how often, in microseconds, a waiter checks that its peer is still alive */
+#define SHM_LIVENESS_CHECK 100000
+
+#define LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+static long futex(uint32_t *word, int op, uint32_t value, const struct timespec *timeout)
+{
+  return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+static struct shm_segment *map_segment(const char *path, int flags)
+{
+  struct shm_segment *segment;
+  int fd = open(path, flags, 0600);
+
+  if (fd == -1) {
+    return NULL;
+  }
+  if ((flags & O_CREAT) && ftruncate(fd, sizeof(struct shm_segment)) == -1) {
+    close(fd);
+    return NULL;
+  }
+  segment = mmap(NULL, sizeof(struct shm_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  return segment == MAP_FAILED ? NULL : segment;
+}
+
+/* tells the peer that one of the rings changed, only entering the kernel
+ * when the peer has gone to sleep on its doorbell
+ */
+static void ring_bell(struct shm_stream *stream)
+{
+  struct shm_segment *segment = stream->segment;
+  int peer = !stream->side;
+
+  __atomic_add_fetch(&segment->doorbell[peer], 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&segment->waiting[peer], __ATOMIC_SEQ_CST)) {
+    futex(&segment->doorbell[peer], FUTEX_WAKE, 1, NULL);
+  }
+}
+
+static int peer_alive(struct shm_stream *stream)
+{
+  pid_t pid = LOAD(&stream->segment->pid[!stream->side]);
+  return !pid || kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+static void reset(struct shm_segment *segment)
+{
+  memset(segment, 0, sizeof(*segment));
+  segment->magic = SHM_MAGIC;
+  segment->pid[SHM_SERVER] = getpid();
+  STORE(&segment->state, SHM_LISTENING);
+}
+
+/* creates the segment at path and waits for clients on it */
+int shm_listen(struct shm_stream *stream, const char *path)
+{
+  stream->side = SHM_SERVER;
+  stream->segment = map_segment(path, O_RDWR | O_CREAT);
+  if (!stream->segment) {
+    return -1;
+  }
+  reset(stream->segment);
+  return 0;
+}
+
+/* blocks until a client has connected to a listening segment */
+int shm_accept(struct shm_stream *stream)
+{
+  struct shm_segment *segment = stream->segment;
+  struct timespec ts = { 1, 0 };
+  uint32_t doorbell;
+
+  while (LOAD(&segment->state) != SHM_CONNECTED) {
+    doorbell = __atomic_load_n(&segment->doorbell[SHM_SERVER], __ATOMIC_SEQ_CST);
+    __atomic_store_n(&segment->waiting[SHM_SERVER], 1, __ATOMIC_SEQ_CST);
+    if (LOAD(&segment->state) != SHM_CONNECTED) {
+      futex(&segment->doorbell[SHM_SERVER], FUTEX_WAIT, doorbell, &ts);
+    }
+    __atomic_store_n(&segment->waiting[SHM_SERVER], 0, __ATOMIC_SEQ_CST);
+  }
+  return 0;
+}
+
+int shm_connect(struct shm_stream *stream, const char *path)
+{
+  uint32_t listening = SHM_LISTENING;
+
+  stream->side = SHM_CLIENT;
+  stream->segment = map_segment(path, O_RDWR);
+  if (!stream->segment) {
+    return -1;
+  }
+  if (stream->segment->magic != SHM_MAGIC ||
+      !__atomic_compare_exchange_n(&stream->segment->state, &listening, SHM_CONNECTED, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    munmap(stream->segment, sizeof(struct shm_segment));
+    errno = ECONNREFUSED;
+    return -1;
+  }
+  STORE(&stream->segment->pid[SHM_CLIENT], getpid());
+  ring_bell(stream);
+  return 0;
+}
+
+/* the client unmaps the segment, the server waits for the client to go away
+ * and then listens for the next one
+ */
+void shm_close(struct shm_stream *stream)
+{
+  struct shm_segment *segment = stream->segment;
+  int readable = 1, writable = 0;
+  char buf[4096];
+
+  STORE(&segment->closed[stream->side], 1);
+  ring_bell(stream);
+  if (stream->side == SHM_CLIENT) {
+    munmap(segment, sizeof(struct shm_segment));
+    return;
+  }
+  while (shm_read(stream, buf, sizeof(buf)) != 0) {
+    readable = 1;
+    shm_wait(stream, &readable, &writable, NULL, 0);
+  }
+  reset(segment);
+}
+
+ssize_t shm_read(struct shm_stream *stream, void *buf, size_t n)
+{
+  struct shm_segment *segment = stream->segment;
+  struct shm_ring *ring = &segment->ring[!stream->side];
+  uint64_t head = ring->head, tail = LOAD(&ring->tail), offset, first;
+
+  if (tail == head && LOAD(&segment->closed[!stream->side])) {
+    /* the peer may have written just before closing */
+    tail = LOAD(&ring->tail);
+    if (tail == head) {
+      return 0;
+    }
+  }
+  if (tail == head) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  n = n < tail - head ? n : tail - head;
+  offset = head % SHM_RING_SIZE;
+  first = n < SHM_RING_SIZE - offset ? n : SHM_RING_SIZE - offset;
+  memcpy(buf, ring->data + offset, first);
+  memcpy((char*)buf + first, ring->data, n - first);
+  STORE(&ring->head, head + n);
+  ring_bell(stream);
+  return n;
+}
+
+ssize_t shm_write(struct shm_stream *stream, const void *buf, size_t n)
+{
+  struct shm_segment *segment = stream->segment;
+  struct shm_ring *ring = &segment->ring[stream->side];
+  uint64_t tail = ring->tail, space = SHM_RING_SIZE - (tail - LOAD(&ring->head)), offset, first;
+
+  if (LOAD(&segment->closed[!stream->side])) {
+    errno = EPIPE;
+    return -1;
+  }
+  if (!space) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  n = n < space ? n : space;
+  offset = tail % SHM_RING_SIZE;
+  first = n < SHM_RING_SIZE - offset ? n : SHM_RING_SIZE - offset;
+  memcpy(ring->data + offset, buf, first);
+  memcpy(ring->data, (const char*)buf + first, n - first);
+  STORE(&ring->tail, tail + n);
+  ring_bell(stream);
+  return n;
+}
+
+static void ready(struct shm_stream *stream, int want_read, int want_write, int *readable, int *writable)
+{
+  struct shm_segment *segment = stream->segment;
+  struct shm_ring *in = &segment->ring[!stream->side], *out = &segment->ring[stream->side];
+  int closed = LOAD(&segment->closed[!stream->side]);
+
+  *readable = want_read && (closed || LOAD(&in->tail) != in->head);
+  *writable = want_write && (closed || out->tail - LOAD(&out->head) < SHM_RING_SIZE);
+}
+
+/* waits like select for the requested directions or the timeout, spinning
+ * for up to spin microseconds before sleeping on the doorbell futex
+ */
+int shm_wait(struct shm_stream *stream, int *readable, int *writable, struct timeval *timeout, size_t spin)
+{
+  struct shm_segment *segment = stream->segment;
+  int want_read = *readable, want_write = *writable, side = stream->side;
+  uint64_t start = microseconds(), now = start, checked = start, deadline = 0, sleep;
+  uint32_t doorbell;
+  struct timespec ts;
+
+  if (timeout) {
+    deadline = start + timeout->tv_sec * (uint64_t) 1000000 + timeout->tv_usec;
+  }
+
+  while (1) {
+    ready(stream, want_read, want_write, readable, writable);
+    if (*readable || *writable) {
+      return !!*readable + !!*writable;
+    }
+    if (timeout && now >= deadline) {
+      return 0;
+    }
+    if (now - checked >= SHM_LIVENESS_CHECK) {
+      checked = now;
+      if (!peer_alive(stream)) {
+        STORE(&segment->closed[!side], 1);
+        continue;
+      }
+    }
+    if (now - start >= spin) {
+      doorbell = __atomic_load_n(&segment->doorbell[side], __ATOMIC_SEQ_CST);
+      __atomic_store_n(&segment->waiting[side], 1, __ATOMIC_SEQ_CST);
+      ready(stream, want_read, want_write, readable, writable);
+      if (!*readable && !*writable) {
+        sleep = SHM_LIVENESS_CHECK;
+        if (timeout && deadline - now < sleep) {
+          sleep = deadline - now;
+        }
+        ts.tv_sec = sleep / 1000000;
+        ts.tv_nsec = (sleep % 1000000) * 1000;
+        futex(&segment->doorbell[side], FUTEX_WAIT, doorbell, &ts);
+      }
+      __atomic_store_n(&segment->waiting[side], 0, __ATOMIC_SEQ_CST);
+    }
+    now = microseconds();
+  }
+}
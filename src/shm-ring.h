@@ -0,0 +1,43 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+/* a pair of single producer single consumer byte rings in a shared file,
+ * carrying the same byte stream a tcp connection would between two
+ * processes on the same host without entering the kernel on the data path
+ */
+#define SHM_RING_SIZE (1 << 20)
+#define SHM_CLIENT 0
+#define SHM_SERVER 1
+
+struct shm_ring {
+  uint64_t head __attribute__((aligned(64)));
+  uint64_t tail __attribute__((aligned(64)));
+  char data[SHM_RING_SIZE] __attribute__((aligned(64)));
+};
+
+struct shm_segment {
+  uint32_t magic, state;
+  /* futex words rung by the peer after it changes either ring */
+  uint32_t doorbell[2] __attribute__((aligned(64)));
+  uint32_t waiting[2], closed[2];
+  pid_t pid[2];
+  /* ring[SHM_CLIENT] carries client to server bytes */
+  struct shm_ring ring[2];
+};
+
+struct shm_stream {
+  struct shm_segment *segment;
+  int side;
+};
+
+int shm_listen(struct shm_stream *stream, const char *path);
+int shm_accept(struct shm_stream *stream);
+int shm_connect(struct shm_stream *stream, const char *path);
+void shm_close(struct shm_stream *stream);
+ssize_t shm_read(struct shm_stream *stream, void *buf, size_t n);
+ssize_t shm_write(struct shm_stream *stream, const void *buf, size_t n);
+int shm_wait(struct shm_stream *stream, int *readable, int *writable, struct timeval *timeout, size_t spin);
+#endif/*SHM_RING_H*/
@@ -11,7 +11,9 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include "pacer.h"
 #include "tcp-shared.h"
+#include "transport.h"
 
 #define SWITCH_TWO(a,b) switch(!!(a) << 1 | !!(b))
 
@@ -19,10 +21,10 @@ struct options {
   int argc;
   char **argv;
 
-  size_t delay, requests, simul;
+  size_t delay, requests, simul, spin, pace_spin;
   char *logfilename;
   int *tcpquickack, *tcpnodelay, *sopriority;
-  char *log_level, wait;
+  char *log_level, wait, pace;
 };
 
 char *app_type = "client";
@@ -30,9 +32,11 @@ static int option_true = 1;
 static int option_false = 0;
 
 static const char usage[] =
-  "usage: %s [-hnqvw] [-d DELAY] [-s NUM_SIMUL] [-l LOGFILE] [-r REQUESTS] HOST PORT REQUEST_SIZE RESPONSE_SIZE\n"
+  "usage: %s [-hnqvw] [-b SPIN] [-d DELAY] [-s NUM_SIMUL] [-l LOGFILE] [-r REQUESTS] [-t PACE_SPIN] (HOST PORT | ENDPOINT) REQUEST_SIZE RESPONSE_SIZE\n"
+  "  ENDPOINT    : tcp://HOST:PORT, tcp6://[HOST]:PORT, unix://PATH or shm://PATH\n"
   "  -a          : TCP Quick Ack\n"
   "  -A          : Disable tcp quick ack on outgoing connections\n"
+  "  -b=0        : Busy poll, spinning for up to SPIN microseconds before blocking (on a futex for shm)\n"
   "  -d=0        : Delay between consecutive requests\n"
   "  -h          : Print help and exit\n"
   "  -l=/dev/null: Duplicate all statements to a logfile\n"
@@ -43,6 +47,7 @@ static const char usage[] =
   "  -q          : Quiet printing\n"
   "  -r          : Number of requests to send (default: no limit)\n"
   "  -s=1        : Allow for NUM_SIMUL requests at the same time\n"
+  "  -t          : Pace requests every DELAY on a fixed schedule, sleeping on a timer then spinning the last PACE_SPIN microseconds\n"
   "  -v          : Verbose printing\n"
   "  -w          : Wait for input from stdin after connecting but before sending the normal requests\n"
   ;
@@ -75,9 +80,11 @@ static int optparse(struct options *options)
 
   while (options->argc >= 2 && options->argv[0][0] == '-') {
     switch(options->argv[0][++i]) {
+    case 'b': options->spin = atoll(options->argv[n++]); break;
     case 'd': options->delay = atoll(options->argv[n++]); break;
     case 'r': options->requests = atoll(options->argv[n++]); break;
     case 's': options->simul = atoll(options->argv[n++]); break;
+    case 't': options->pace = 1; options->pace_spin = atoll(options->argv[n++]); break;
     case 'l': options->logfilename = options->argv[n++]; break;
     case 'a': options->tcpquickack = &option_true; break;
     case 'A': options->tcpquickack = &option_false; break;
@@ -110,21 +117,24 @@ static int optparse(struct options *options)
 /* main driver function */
 int main(int argc, char **argv)
 {
-  char *progname = argv[0], *host, *port, addrstr[INET6_ADDRSTRLEN];
-  int clientfd, error;
+  char *progname = argv[0], addrstr[NI_MAXHOST + NI_MAXSERV + 8];
+  int clientfd, error, tcp, args, readable, writable, timerfd, timer, paced = 0;
   ssize_t n = 1;
   size_t iw = 0, ir = 0, delta, requestCount = 0, responseCount = 0, bytesRead = 0, bytesWritten = 0;
   uint64_t readStart = 0, readEnd, writeStart = 0, serverTime, lastRequest = 0;
   int64_t lowerOffset = 1L << 63, upperOffset = ~(1L << 63);
   socklen_t addrlen;
-  fd_set rfds, wfds;
   FILE *logfile = NULL;
+  struct cpu_usage cpuStart;
+  struct pacer pacer;
   struct options options;
   struct request *requests;
   struct request_header * requestBuffer;
   struct response_header * responseBuffer;
   struct setup_header setupBuffer;
-  struct sockaddr_in addr;
+  struct sockaddr_storage addr;
+  struct endpoint endpoint;
+  struct stream stream;
   struct timeval timeout, *timeout_p;
 
   memset(&options, 0, sizeof(struct options));
@@ -135,7 +145,8 @@ int main(int argc, char **argv)
 
   error = optparse(&options);
 
-  if (error || options.argc != 4) {
+  args = error ? -1 : endpoint_args(&endpoint, options.argc, options.argv, SOCK_STREAM);
+  if (args < 0 || options.argc != args + 2) {
     fprintf(stderr, usage, progname);
     return error ? error - 1 : 0;
   }
@@ -144,10 +155,8 @@ int main(int argc, char **argv)
     logfile = fopen(options.logfilename, "a");
   }
 
-  host = options.argv[0];
-  port = options.argv[1];
-  setupBuffer.request_size = atol(options.argv[2]);
-  setupBuffer.response_size = atol(options.argv[3]);
+  setupBuffer.request_size = atol(options.argv[args]);
+  setupBuffer.response_size = atol(options.argv[args + 1]);
   setupBuffer.simul = options.simul;
   setupBuffer.requests = options.requests;
 
@@ -166,28 +175,47 @@ int main(int argc, char **argv)
   requests = calloc(setupBuffer.simul + 1, sizeof(struct request));
 
   /* looks up server and connects */
-  if((clientfd = open_socketfd(host, port, AI_V4MAPPED, SOCK_STREAM, &connect)) < 0)
+  if (endpoint_is_shm(&endpoint)) {
+    if (shm_connect(&stream.shm, endpoint.path)) {
+      perror("shm_connect");
+      fprintf(stderr, "Error connecting to server %s\n", endpoint.path);
+      return 1;
+    }
+    clientfd = -1;
+  } else if((clientfd = endpoint_open(&endpoint, AI_V4MAPPED, &connect)) < 0)
   {
     fprintf(stderr, "Error connecting to server %d\n", clientfd);
     return 1;
   }
+  stream.fd = clientfd;
 
   LOG(logfile, LOG_LEVEL_L, "connected\n");
 
-  addrlen = sizeof(addr);
-  if (getsockname(clientfd, (struct sockaddr*)&addr, (socklen_t*)&addrlen)) {
-    fprintf(stderr, "Error getting socket name\n");
+  if (clientfd != -1) {
+    addrlen = sizeof(addr);
+    if (getsockname(clientfd, (struct sockaddr*)&addr, (socklen_t*)&addrlen)) {
+      fprintf(stderr, "Error getting socket name\n");
+    } else {
+      sockaddr_string((struct sockaddr*)&addr, addrlen, addrstr, sizeof(addrstr));
+      LOGF(logfile, LOG_LEVEL_L, "Connected from %s\n", addrstr);
+    }
+
+    addrlen = sizeof(addr);
+    if (getpeername(clientfd, (struct sockaddr*)&addr, (socklen_t*)&addrlen)) {
+      fprintf(stderr, "Error getting socket name\n");
+    } else {
+      sockaddr_string((struct sockaddr*)&addr, addrlen, addrstr, sizeof(addrstr));
+      LOGF(logfile, LOG_LEVEL_L, "Connected to %s\n", addrstr);
+    }
   } else {
-    inet_ntop(AF_INET, &addr.sin_addr, addrstr, sizeof(addrstr));
-    LOGF(logfile, LOG_LEVEL_L, "Connected from %s:%d\n", addrstr, ntohs(addr.sin_port));
+    LOGF(logfile, LOG_LEVEL_L, "Connected to shm:%s\n", endpoint.path);
+    options.sopriority = NULL;
   }
 
-  addrlen = sizeof(addr);
-  if (getpeername(clientfd, (struct sockaddr*)&addr, (socklen_t*)&addrlen)) {
-    fprintf(stderr, "Error getting socket name\n");
-  } else {
-    inet_ntop(AF_INET, &addr.sin_addr, addrstr, sizeof(addrstr));
-    LOGF(logfile, LOG_LEVEL_L, "Connected to %s:%d\n", addrstr, ntohs(addr.sin_port));
+  /* tcp options do not apply to unix domain sockets or shared memory */
+  tcp = endpoint_is_inet(&endpoint);
+  if (!tcp) {
+    options.tcpnodelay = options.tcpquickack = NULL;
   }
 
   if (options.wait) {
@@ -199,31 +227,50 @@ int main(int argc, char **argv)
   SETSOCKOPT(logfile, LOG_LEVEL_L, clientfd, IPPROTO_TCP, TCP_QUICKACK, options.tcpquickack);
 
   writeStart = microseconds();
-  write(clientfd, &setupBuffer, sizeof(setupBuffer));
+  stream_write_all(&stream, &setupBuffer, sizeof(setupBuffer));
 
 
-  read(clientfd, &serverTime, sizeof(uint64_t));
+  stream_read_all(&stream, &serverTime, sizeof(uint64_t));
   readEnd = microseconds();
   LOGF(logfile, LOG_LEVEL_V, "initial time offset %lu-%lu-%lu deltas of %ld %ld and transit time %lu\n", writeStart, serverTime, readEnd, serverTime - writeStart, readEnd - serverTime, readEnd - writeStart);
   time_offset(writeStart, serverTime, serverTime, readEnd, &lowerOffset, &upperOffset);
   LOGF(logfile, LOG_LEVEL_V, "calculating an initial offset of +/- %ld %ld\n", lowerOffset, upperOffset);
-  LOGSOCKOPT(logfile, LOG_LEVEL_L, clientfd, SOL_SOCKET, SO_PRIORITY);
-  LOGSOCKOPT(logfile, LOG_LEVEL_L, clientfd, IPPROTO_TCP, TCP_NODELAY);
-  LOGSOCKOPT(logfile, LOG_LEVEL_L, clientfd, IPPROTO_TCP, TCP_QUICKACK);
+  if (clientfd != -1) {
+    LOGSOCKOPT(logfile, LOG_LEVEL_L, clientfd, SOL_SOCKET, SO_PRIORITY);
+    busy_poll_setup(logfile, LOG_LEVEL_L, clientfd, options.spin);
+  }
+  if (tcp) {
+    LOGSOCKOPT(logfile, LOG_LEVEL_L, clientfd, IPPROTO_TCP, TCP_NODELAY);
+    LOGSOCKOPT(logfile, LOG_LEVEL_L, clientfd, IPPROTO_TCP, TCP_QUICKACK);
+  }
 
+  cpu_usage(&cpuStart);
+
+  if (options.pace && pacer_init(&pacer, options.delay, options.pace_spin) < 0) {
+    perror("timerfd_create");
+    return 1;
+  }
 
   while (!setupBuffer.requests || responseCount < setupBuffer.requests) {
-    FD_ZERO(&rfds);
-    if (responseCount < requestCount) {
-      FD_SET(clientfd, &rfds);
-    }
+    readable = responseCount < requestCount;
+    writable = 0;
+    timerfd = -1;
 
     delta = microseconds() - lastRequest;
-    FD_ZERO(&wfds);
 
-    SWITCH_TWO(requestCount - responseCount < setupBuffer.simul, delta > options.delay) {
+    if (options.pace) {
+      timeout_p = NULL;
+      if (requestCount - responseCount < setupBuffer.simul) {
+        if (bytesWritten || pacer_ready(&pacer)) {
+          writable = 1;
+        } else {
+          pacer_arm(&pacer);
+          timerfd = pacer.timerfd;
+        }
+      }
+    } else SWITCH_TWO(requestCount - responseCount < setupBuffer.simul, delta > options.delay) {
     case 3:
-      FD_SET(clientfd, &wfds);
+      writable = 1;
     case 1:
       timeout_p = NULL;
       break;
@@ -237,16 +284,25 @@ int main(int argc, char **argv)
       timeout_p = NULL;
     }
 
-    LOGSOCKOPT(logfile, LOG_LEVEL_V, clientfd, IPPROTO_TCP, TCP_NODELAY);
-    LOGSOCKOPT(logfile, LOG_LEVEL_V, clientfd, IPPROTO_TCP, TCP_QUICKACK);
-    select(clientfd+1, &rfds, &wfds, NULL, timeout_p);
+    if (tcp) {
+      LOGSOCKOPT(logfile, LOG_LEVEL_V, clientfd, IPPROTO_TCP, TCP_NODELAY);
+      LOGSOCKOPT(logfile, LOG_LEVEL_V, clientfd, IPPROTO_TCP, TCP_QUICKACK);
+    }
+    stream_wait(&stream, &readable, &writable, timerfd, &timer, timeout_p, options.spin);
+
+    if (timer) {
+      pacer_clear(&pacer);
+    }
 
-    if (FD_ISSET(clientfd, &rfds)) {
+    if (readable) {
       if (!bytesRead) {
         readStart = microseconds();
       }
-      n = read(clientfd, ((char*)responseBuffer) + bytesRead, setupBuffer.response_size - bytesRead);
+      n = stream_read(&stream, ((char*)responseBuffer) + bytesRead, setupBuffer.response_size - bytesRead);
       readEnd = microseconds();
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        continue;
+      }
       if (n < 0)
       {
         perror("read: ");
@@ -320,19 +376,29 @@ int main(int argc, char **argv)
       }
     }
 
-    if (FD_ISSET(clientfd, &wfds)) {
-      LOGSOCKOPT(logfile, LOG_LEVEL_V, clientfd, IPPROTO_TCP, TCP_QUICKACK);
+    if (writable) {
+      if (tcp) {
+        LOGSOCKOPT(logfile, LOG_LEVEL_V, clientfd, IPPROTO_TCP, TCP_QUICKACK);
+      }
       if (!bytesWritten) {
         iw = request_find_slot(requests, 0, iw, setupBuffer.simul + 1);
         requestBuffer->seq = requestCount + 1;
         requestBuffer->index = iw + 1;
+        /* a retry after EAGAIN keeps the slot it already waited for */
+        if (options.pace && !paced) {
+          pacer_wait(&pacer);
+          paced = 1;
+        }
         requests[iw].request_write_start = microseconds();
       }
-      n = write(clientfd, ((char*)requestBuffer) + bytesWritten, setupBuffer.request_size - bytesWritten);
+      n = stream_write(&stream, ((char*)requestBuffer) + bytesWritten, setupBuffer.request_size - bytesWritten);
       requests[iw].request_write_end = microseconds();
 
       SETSOCKOPT(logfile, LOG_LEVEL_V, clientfd, IPPROTO_TCP, TCP_QUICKACK, options.tcpquickack);
 
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        continue;
+      }
       if (n < 0) {
         perror("write: ");
         fprintf(stderr, "Error writing to socket\n");
@@ -345,6 +411,10 @@ int main(int argc, char **argv)
 
       LOGF(logfile, LOG_LEVEL_V, "wrote %ld bytes to socket\n", n);
 
+      if (!bytesWritten && paced) {
+        pacer_sent(&pacer);
+        paced = 0;
+      }
       bytesWritten += n;
       if (bytesWritten == setupBuffer.request_size) {
         bytesWritten = 0;
@@ -355,7 +425,16 @@ int main(int argc, char **argv)
       }
     }
   }
-  close(clientfd);
+  log_cpu_usage(logfile, LOG_LEVEL_L, &cpuStart, responseCount);
+  if (options.pace) {
+    log_pacer(logfile, LOG_LEVEL_L, &pacer);
+    pacer_close(&pacer);
+  }
+  if (clientfd != -1) {
+    close(clientfd);
+  } else {
+    shm_close(&stream.shm);
+  }
   if (logfile) {
     fclose(logfile);
   }
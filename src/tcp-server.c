@@ -1,4 +1,5 @@
 #define MAIN
+#include <errno.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <sys/wait.h>
@@ -12,6 +13,7 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include "tcp-shared.h"
+#include "transport.h"
 #define LISTEN_MAX 8
 #define MAXLINE 256
 
@@ -22,6 +24,7 @@ struct options {
   char *logfilename;
   int *tcpquickack, *tcpnodelay, *sopriority;
   char *log_level;
+  size_t spin;
 };
 
 static int option_true = 1;
@@ -29,9 +32,11 @@ static int option_false = 0;
 char* app_type = "server";
 
 static const char usage[] =
-  "usage: %s [-aAhnNpPqv] [-l LOGFILE] PORT\n"
+  "usage: %s [-aAhnNpPqv] [-b SPIN] [-l LOGFILE] (PORT | ENDPOINT)\n"
+  "  ENDPOINT    : tcp://HOST:PORT, tcp6://[HOST]:PORT, unix://PATH or shm://PATH, HOST may be empty\n"
   "  -a          : Use tcp quick ack on outgoing connections\n"
   "  -A          : Disable tcp quick ack on outgoing connections\n"
+  "  -b=0        : Busy poll, spinning for up to SPIN microseconds before blocking (on a futex for shm)\n"
   "  -h          : Print help and exit\n"
   "  -l=/dev/null: Duplicate all statements to a logfile\n"
   "  -n          : Use tcp no delay on outgoing connections\n"
@@ -58,8 +63,9 @@ void* clean(void* v)
   }
 }
 
-int respond(int connfd, size_t port, FILE *logfile, int *tcpquickack)
+int respond(struct stream *stream, size_t port, FILE *logfile, int tcp, int *tcpquickack, size_t spin)
 {
+  int connfd = stream->fd, readable, writable;
   struct setup_header setupBuffer;
   size_t  bytesRead = 0, requestCount = 0, bytesWritten = 0, responseCount = 0, qh = 0, qt = 0;
   ssize_t n;
@@ -67,19 +73,21 @@ int respond(int connfd, size_t port, FILE *logfile, int *tcpquickack)
   struct request_header *requestBuffer;
   struct response_header *responseBuffer;
   struct request *requests;
-  fd_set rfds, wfds;
+  struct cpu_usage cpuStart;
 
-  n = read(connfd, &setupBuffer, sizeof(struct setup_header));
+  n = stream_read_all(stream, &setupBuffer, sizeof(struct setup_header));
   readEnd = microseconds();
   if (n != sizeof(struct setup_header)) {
     fprintf(stderr, "Failed to read setup from connection on port %lu\n", port);
     return -1;
   }
 
-  write(connfd, &readEnd, sizeof(uint64_t));
+  stream_write_all(stream, &readEnd, sizeof(uint64_t));
   LOGF(logfile, LOG_LEVEL_L, "client %lu sending %lu requests of size %lu expecting responses of size %lu\n", port, setupBuffer.requests, setupBuffer.request_size, setupBuffer.response_size);
-  LOGSOCKOPT(logfile, LOG_LEVEL_L, connfd, IPPROTO_TCP, TCP_QUICKACK);
-  LOGSOCKOPT(logfile, LOG_LEVEL_L, connfd, IPPROTO_TCP, TCP_NODELAY);
+  if (tcp) {
+    LOGSOCKOPT(logfile, LOG_LEVEL_L, connfd, IPPROTO_TCP, TCP_QUICKACK);
+    LOGSOCKOPT(logfile, LOG_LEVEL_L, connfd, IPPROTO_TCP, TCP_NODELAY);
+  }
   requestBuffer = malloc(setupBuffer.request_size);
   responseBuffer = malloc(setupBuffer.response_size);
   requests = calloc(setupBuffer.simul + 1, sizeof(struct request));
@@ -90,31 +98,34 @@ int respond(int connfd, size_t port, FILE *logfile, int *tcpquickack)
   responseBuffer->prev_index = 0;
   responseBuffer->prev_write_end = microseconds();
 
+  if (connfd != -1) {
+    busy_poll_setup(logfile, LOG_LEVEL_L, connfd, spin);
+  }
+  cpu_usage(&cpuStart);
+
   while (!setupBuffer.requests || responseCount < setupBuffer.requests) {
-    FD_ZERO(&rfds);
-    if (!setupBuffer.requests || requestCount < setupBuffer.requests) {
-      FD_SET(connfd, &rfds);
-    }
+    readable = !setupBuffer.requests || requestCount < setupBuffer.requests;
+    writable = responseCount < requestCount;
 
-    FD_ZERO(&wfds);
-    if (responseCount < requestCount) {
-      FD_SET(connfd, &wfds);
+    if (tcp) {
+      LOGSOCKOPT(logfile, LOG_LEVEL_V, connfd, IPPROTO_TCP, TCP_NODELAY);
+      LOGSOCKOPT(logfile, LOG_LEVEL_V, connfd, IPPROTO_TCP, TCP_QUICKACK);
     }
-
-    LOGSOCKOPT(logfile, LOG_LEVEL_V, connfd, IPPROTO_TCP, TCP_NODELAY);
-    LOGSOCKOPT(logfile, LOG_LEVEL_V, connfd, IPPROTO_TCP, TCP_QUICKACK);
     LOGF(logfile, LOG_LEVEL_V, "selecting requests, %lu requests recieved %lu responses written\n", requestCount, responseCount);
-    select(connfd+1, &rfds, &wfds, NULL, NULL);
+    stream_wait(stream, &readable, &writable, -1, NULL, NULL, spin);
 
-    if (FD_ISSET(connfd, &rfds)) {
+    if (readable) {
       LOGF(logfile, LOG_LEVEL_V, "reading %ld bytes from port %lu\n", setupBuffer.request_size - bytesRead, port);
 
       if (bytesRead == 0) {
         requests[qt].request_read_start = microseconds();
       }
-      n = read(connfd, ((char*)requestBuffer) + bytesRead, setupBuffer.request_size - bytesRead);
+      n = stream_read(stream, ((char*)requestBuffer) + bytesRead, setupBuffer.request_size - bytesRead);
       requests[qt].request_read_end = microseconds();
 
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        continue;
+      }
       if (n < 0) {
         perror("read: ");
         fprintf(stderr, "Failed to read request from connection on port %lu\n", port);
@@ -138,7 +149,7 @@ int respond(int connfd, size_t port, FILE *logfile, int *tcpquickack)
       }
     }
 
-    if (FD_ISSET(connfd, &wfds)) {
+    if (writable) {
       if (bytesWritten == 0) {
         responseBuffer->seq = requests[qh].seq;
         responseBuffer->index = requests[qh].index;
@@ -148,11 +159,14 @@ int respond(int connfd, size_t port, FILE *logfile, int *tcpquickack)
         responseBuffer->write_start = microseconds();
         LOGF(logfile, LOG_LEVEL_V, "starting write to port %lu for %lu reading from index %lu to index %lu (previous index %lu)\n", port, responseBuffer->seq, qh, responseBuffer->index, responseBuffer->prev_index);
       }
-      n = write(connfd, ((char*)responseBuffer) + bytesWritten, setupBuffer.response_size - bytesWritten);
+      n = stream_write(stream, ((char*)responseBuffer) + bytesWritten, setupBuffer.response_size - bytesWritten);
       writeEnd = microseconds();
 
       SETSOCKOPT(logfile, LOG_LEVEL_V, connfd, IPPROTO_TCP, TCP_QUICKACK, tcpquickack);
 
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        continue;
+      }
       if (n < 0) {
         perror("write: ");
         fprintf(stderr, "Failed to write request to connection on port %lu\n", port);
@@ -176,6 +190,7 @@ int respond(int connfd, size_t port, FILE *logfile, int *tcpquickack)
       }
     }
   }
+  log_cpu_usage(logfile, LOG_LEVEL_L, &cpuStart, responseCount);
   free(requestBuffer);
   free(responseBuffer);
   free(requests);
@@ -189,6 +204,7 @@ static int optparse(struct options *options)
 
   while (options->argc >= 2 && options->argv[0][0] == '-') {
     switch(options->argv[0][++i]) {
+    case 'b': options->spin = atoll(options->argv[n++]); break;
     case 'l': options->logfilename = &options->argv[0][n++]; break;
     case 'a': options->tcpquickack = &option_true; break;
     case 'A': options->tcpquickack = &option_false; break;
@@ -217,23 +233,43 @@ static int optparse(struct options *options)
   return 0;
 }
 
+/* shared memory has no accept queue, so clients are served one at a time */
+static int serve_shm(struct endpoint *endpoint, FILE *logfile, struct options *options)
+{
+  struct stream stream;
+  size_t total = 0;
+
+  stream.fd = -1;
+  if (shm_listen(&stream.shm, endpoint->path)) {
+    perror("shm_listen");
+    fprintf(stderr, "Error : Cannot create shared memory segment %s\n", endpoint->path);
+    return 1;
+  }
+  LOG(logfile, LOG_LEVEL_L, "listening\n");
+
+  while (1) {
+    shm_accept(&stream.shm);
+    LOGF(logfile, LOG_LEVEL_L, "connected to shm:%s : %lu\n", endpoint->path, ++total);
+    respond(&stream, total, logfile, 0, NULL, options->spin);
+    LOGF(logfile, LOG_LEVEL_L, "server: closing connection to shm:%s : %lu\n", endpoint->path, total);
+    shm_close(&stream.shm);
+  }
+}
 
 /* driver function */
 int main(int argc, char **argv)
 {
   char hostaddr[MAXLINE], hostname[MAXLINE], *progname = argv[0], *portstring;
-  int listenfd, connfd, error, pid, threaded = 0;
+  int listenfd, connfd, error, pid, threaded = 0, tcp;
   size_t port, total = 0;
   FILE *logfile = NULL;
   sem_t count;
   struct options options;
+  struct endpoint endpoint;
   pthread_t cleaning;
   socklen_t clientlen;
-  union
-  {
-    struct sockaddr_in client4;
-    struct sockaddr_in6 client6;
-  } clientaddr;
+  struct sockaddr_storage clientaddr;
+  struct stream stream;
 
   if (sem_init(&count, 0, 0) == -1 || pthread_create(&cleaning, NULL, clean, &count) != 0) {
     perror(NULL);
@@ -249,6 +285,12 @@ int main(int argc, char **argv)
 
   error = optparse(&options);
 
+  if (!error && options.argc == 1 && strstr(options.argv[0], "://")) {
+    error = endpoint_parse(&endpoint, options.argv[0], SOCK_STREAM) ? 2 : 0;
+  } else if (!error && options.argc == 1) {
+    endpoint_inet(&endpoint, NULL, options.argv[0], SOCK_STREAM);
+  }
+
   if (error || options.argc != 1) {
     fprintf(stderr, usage, progname);
     return error ? error - 1 : 0;
@@ -260,13 +302,23 @@ int main(int argc, char **argv)
 
   portstring = options.argv[0];
 
-  listenfd = open_socketfd(NULL, portstring, AI_PASSIVE, SOCK_STREAM, &bind);
+  if (endpoint_is_shm(&endpoint)) {
+    return serve_shm(&endpoint, logfile, &options);
+  }
+
+  listenfd = endpoint_open(&endpoint, AI_PASSIVE, &bind);
 
   if(listenfd < 0) {
     fprintf(stderr, "Error : Cannot listen to socket %s with error %d\n", portstring, listenfd);
     return 1;
   }
 
+  /* tcp options do not apply to unix domain sockets */
+  tcp = endpoint_is_inet(&endpoint);
+  if (!tcp) {
+    options.tcpnodelay = options.tcpquickack = NULL;
+  }
+
   SETSOCKOPT(logfile, LOG_LEVEL_V, listenfd, SOL_SOCKET, SO_REUSEADDR, &option_true);
   SETSOCKOPT(logfile, LOG_LEVEL_L, listenfd, SOL_SOCKET, SO_PRIORITY, options.sopriority);
   SETSOCKOPT(logfile, LOG_LEVEL_L, listenfd, IPPROTO_TCP, TCP_NODELAY, options.tcpnodelay);
@@ -287,19 +339,31 @@ int main(int argc, char **argv)
     }
 
     LOGSOCKOPT(logfile, LOG_LEVEL_L, connfd, SOL_SOCKET, SO_PRIORITY);
-    LOGSOCKOPT(logfile, LOG_LEVEL_L, connfd, IPPROTO_TCP, TCP_NODELAY);
-    LOGSOCKOPT(logfile, LOG_LEVEL_L, connfd, IPPROTO_TCP, TCP_QUICKACK);
+    if (tcp) {
+      LOGSOCKOPT(logfile, LOG_LEVEL_L, connfd, IPPROTO_TCP, TCP_NODELAY);
+      LOGSOCKOPT(logfile, LOG_LEVEL_L, connfd, IPPROTO_TCP, TCP_QUICKACK);
+
+      error = getnameinfo((struct sockaddr*)&clientaddr, clientlen, hostname, sizeof(hostname), NULL, 0, 0);
+      if (error != 0) {
+        /* no reverse mapping, common for ipv6 loopback */
+        error = getnameinfo((struct sockaddr*)&clientaddr, clientlen, hostname, sizeof(hostname), NULL, 0, NI_NUMERICHOST);
+      }
+      if (error != 0) {
+        close(connfd);
+        continue;
+      }
+      error = getnameinfo((struct sockaddr*)&clientaddr, clientlen, hostaddr, sizeof(hostaddr), NULL, 0, NI_NUMERICHOST);
 
-    error = getnameinfo((struct sockaddr*)&clientaddr, clientlen, hostname, sizeof(hostname), NULL, 0, 0);
-    if (error != 0) {
-      close(connfd);
-      continue;
+      port = ntohs(((struct sockaddr*)&clientaddr)->sa_family == AF_INET
+           ? ((struct sockaddr_in*)&clientaddr)->sin_port
+           : ((struct sockaddr_in6*)&clientaddr)->sin6_port);
+    } else {
+      /* unix clients are usually unnamed, number them instead */
+      strcpy(hostname, "localhost");
+      sockaddr_string((struct sockaddr*)&clientaddr, clientlen, hostaddr, sizeof(hostaddr));
+      port = total + 1;
+      error = 0;
     }
-    error = getnameinfo((struct sockaddr*)&clientaddr, clientlen, hostaddr, sizeof(hostaddr), NULL, 0, NI_NUMERICHOST);
-
-    port = ntohs(((struct sockaddr*)&clientaddr)->sa_family == AF_INET
-         ? ((struct sockaddr_in*)&clientaddr)->sin_port
-         : ((struct sockaddr_in6*)&clientaddr)->sin6_port);
     if (error) {
       LOGF(logfile, LOG_LEVEL_L, "connected to %s : %lu\n", hostname, port);
     } else {
@@ -308,7 +372,8 @@ int main(int argc, char **argv)
 
     if ((pid = fork()) == 0) {
       close(listenfd);
-      respond(connfd, port, logfile, options.tcpquickack);
+      stream.fd = connfd;
+      respond(&stream, port, logfile, tcp, options.tcpquickack, options.spin);
       LOGF(logfile, LOG_LEVEL_L, "server: closing connection to %s (%s) : %lu\n", hostname, hostaddr, port);
       if (logfile) {
         fclose(logfile);
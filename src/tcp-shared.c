@@ -1,7 +1,10 @@
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <netdb.h>
 #include "tcp-shared.h"
 
@@ -10,3 +13,115 @@ size_t request_find_slot(struct request* requests, size_t seq, size_t last, size
   return last;
 }
 
+ssize_t stream_read(struct stream *stream, void *buf, size_t n)
+{
+  return stream->fd == -1 ? shm_read(&stream->shm, buf, n) : read(stream->fd, buf, n);
+}
+
+ssize_t stream_write(struct stream *stream, const void *buf, size_t n)
+{
+  return stream->fd == -1 ? shm_write(&stream->shm, buf, n) : write(stream->fd, buf, n);
+}
+
+/* blocking reads and writes for the setup exchange, returning n on success */
+ssize_t stream_read_all(struct stream *stream, void *buf, size_t n)
+{
+  size_t done = 0;
+  ssize_t r;
+  int readable, writable = 0;
+
+  while (done < n) {
+    r = stream_read(stream, (char*)buf + done, n - done);
+    if (r == 0) {
+      return done;
+    }
+    if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      return -1;
+    }
+    if (r < 0) {
+      readable = 1;
+      stream_wait(stream, &readable, &writable, -1, NULL, NULL, 0);
+      continue;
+    }
+    done += r;
+  }
+  return done;
+}
+
+ssize_t stream_write_all(struct stream *stream, const void *buf, size_t n)
+{
+  size_t done = 0;
+  ssize_t r;
+  int readable = 0, writable;
+
+  while (done < n) {
+    r = stream_write(stream, (const char*)buf + done, n - done);
+    if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      return -1;
+    }
+    if (r <= 0) {
+      writable = 1;
+      stream_wait(stream, &readable, &writable, -1, NULL, NULL, 0);
+      continue;
+    }
+    done += r;
+  }
+  return done;
+}
+
+/* waits for the stream to become readable or writable, as requested by the
+ * flags, for timerfd to expire or for the timeout, spinning for up to spin
+ * microseconds first, and updates the flags to what is ready
+ */
+int stream_wait(struct stream *stream, int *readable, int *writable, int timerfd, int *timer, struct timeval *timeout, size_t spin)
+{
+  fd_set rfds, wfds;
+  struct itimerspec its;
+  struct timeval remaining, zero;
+  int n, nfds = stream->fd;
+
+  if (stream->fd != -1) {
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    if (*readable) {
+      FD_SET(stream->fd, &rfds);
+    }
+    if (*writable) {
+      FD_SET(stream->fd, &wfds);
+    }
+    if (timerfd != -1) {
+      FD_SET(timerfd, &rfds);
+      nfds = timerfd > nfds ? timerfd : nfds;
+    }
+    n = spin_select(nfds + 1, &rfds, &wfds, timeout, spin);
+    *readable = n > 0 && FD_ISSET(stream->fd, &rfds);
+    *writable = n > 0 && FD_ISSET(stream->fd, &wfds);
+    if (timer) {
+      *timer = n > 0 && timerfd != -1 && FD_ISSET(timerfd, &rfds);
+    }
+    return n;
+  }
+
+  /* the futex cannot wait on the timer, so sleep no longer than it has left,
+   * an expired timer has nothing left
+   */
+  if (timerfd != -1 && timerfd_gettime(timerfd, &its) == 0) {
+    remaining.tv_sec = its.it_value.tv_sec;
+    remaining.tv_usec = its.it_value.tv_nsec / 1000;
+    if (!timeout || timercmp(&remaining, timeout, <)) {
+      timeout = &remaining;
+    }
+  }
+  n = shm_wait(&stream->shm, readable, writable, timeout, spin);
+  if (timer) {
+    *timer = 0;
+    if (timerfd != -1) {
+      FD_ZERO(&rfds);
+      FD_SET(timerfd, &rfds);
+      zero.tv_sec = zero.tv_usec = 0;
+      *timer = select(timerfd + 1, &rfds, NULL, NULL, &zero) > 0;
+      n += *timer;
+    }
+  }
+  return n;
+}
@@ -1,5 +1,6 @@
 #ifndef TCP_SHARED_H
 #define TCP_SHARED_H
+#include "shm-ring.h"
 #include "traffic-shared.h"
 struct setup_header {
   uint64_t requests, request_size, response_size, simul;
@@ -20,6 +21,19 @@ struct request {
   uint64_t response_write_start, response_write_end, response_rcvd, response_read_start, response_read_end;
 };
 
+/* the connection the protocol runs over, a socket when fd is not -1 and
+ * otherwise a shared memory ring
+ */
+struct stream {
+  int fd;
+  struct shm_stream shm;
+};
+
 size_t request_find_slot(struct request* requests, size_t seq, size_t expected, size_t size);
-#endif/*TCP_SHARED_H*/
 
+ssize_t stream_read(struct stream *stream, void *buf, size_t n);
+ssize_t stream_write(struct stream *stream, const void *buf, size_t n);
+ssize_t stream_read_all(struct stream *stream, void *buf, size_t n);
+ssize_t stream_write_all(struct stream *stream, const void *buf, size_t n);
+int stream_wait(struct stream *stream, int *readable, int *writable, int timerfd, int *timer, struct timeval *timeout, size_t spin);
+#endif/*TCP_SHARED_H*/
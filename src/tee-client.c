@@ -1,5 +1,7 @@
+#define _GNU_SOURCE
 #define MAIN
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,23 +9,76 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include "tee-sequence.h"
+#include "transport.h"
 #include "udp-shared.h"
+/* lines longer than this, or than the packed datagram size, are sent in pieces */
 #define MAXLINE 4096
+#define MAX_PACK 65507
+/* stdin is read into a ring that lines are sent and echoed from in place */
+#define RING_SIZE (1 << 20)
+#define BATCH_LINES 1024
+/* after stdin ends, NAKs are still answered until none has come for this long */
+#define RECOVERY_LINGER 200000
+/* with -z, pipes are grown to this so each tee and splice moves more */
+#define SPLICE_SIZE (1 << 20)
+
+/* positions count every byte read from stdin, the ring holds the bytes from
+   start, the first one not yet sent, up to end. with packing the whole lines
+   from start to line wait for the datagram to fill up or its deadline, which
+   is counted from opened */
+struct ring {
+  char data[RING_SIZE];
+  uint64_t start, line, scanned, end;
+  uint64_t opened;
+};
+
+struct batch {
+  struct mmsghdr msgs[BATCH_LINES];
+  struct iovec iovs[3 * BATCH_LINES];
+  char headers[BATCH_LINES][TEE_HEADER_SIZE];
+  size_t count;
+};
+
+/* copies of the last datagrams sent, by sequence number, for resending on a NAK */
+struct retransmit {
+  char *slots;
+  uint64_t *seqs;
+  size_t *lengths;
+  size_t count, stride;
+  uint64_t resent, expired;
+};
 
 struct options {
   int argc;
   char **argv;
+
+  size_t pack, deadline, retransmit;
+  uint32_t stream;
+  int sequenced;
+  char *splice;
 };
 
 char *app_type = "client";
 
 static const char usage[] =
-  "usage: %s HOST PORT\n"
+  "usage: %s [-hs] [-d DEADLINE] [-i ID] [-m SIZE] [-r SLOTS] HOST PORT\n"
+  "       %s -z ENDPOINT\n"
+  "  -d=1000     : With -m, microseconds a partly filled datagram may wait for more lines\n"
   "  -h          : Print help and exit\n"
+  "  -i=PID      : With -s, the stream id the server tells this sender apart by\n"
+  "  -m=0        : Pack as many whole lines as fit into datagrams of up to SIZE bytes, 0 sends one line each\n"
+  "  -r=0        : Keep the last SLOTS datagrams and resend those the server NAKs, implies -s\n"
+  "  -s          : Start each datagram with a stream id and sequence number, so the server sees losses\n"
+  "  -z          : Copy a stdin pipe to stdout and to the tcp:// or unix:// ENDPOINT as a byte stream,\n"
+  "                with tee(2) and splice(2) so the data never enters user space\n"
   ;
 
 static int optparse(struct options *options)
@@ -33,6 +88,12 @@ static int optparse(struct options *options)
 
   while (options->argc >= 2 && options->argv[0][0] == '-') {
     switch(options->argv[0][++i]) {
+    case 'd': options->deadline = atoll(options->argv[n++]); break;
+    case 'i': options->stream = atol(options->argv[n++]); break;
+    case 'r': options->retransmit = atoll(options->argv[n++]); options->sequenced = 1; break;
+    case 's': options->sequenced = 1; break;
+    case 'z': options->splice = options->argv[n++]; break;
+    case 'm': options->pack = atoll(options->argv[n++]); break;
     case 'h': return 1;
     case '-':
       options->argc -= n;
@@ -61,25 +122,292 @@ static int save(int fd, const struct sockaddr *addr, socklen_t len) {
    return 0;
 }
 
+static int sequenced;
+static uint32_t stream_id;
+static uint64_t next_seq;
+static struct retransmit retransmit;
+
+/* points iov at the bytes from start to end, in two pieces if they wrap */
+static size_t ring_iov(struct ring *ring, uint64_t start, uint64_t end, struct iovec *iov)
+{
+  size_t offset = start % RING_SIZE, length = end - start;
+
+  iov[0].iov_base = ring->data + offset;
+  if (offset + length <= RING_SIZE) {
+    iov[0].iov_len = length;
+    return 1;
+  }
+  iov[0].iov_len = RING_SIZE - offset;
+  iov[1].iov_base = ring->data;
+  iov[1].iov_len = length - iov[0].iov_len;
+  return 2;
+}
+
+static void batch_flush(int fd, struct batch *batch)
+{
+  size_t i = 0;
+  int sent;
+
+  while (i < batch->count) {
+    if ((sent = sendmmsg(fd, batch->msgs + i, batch->count - i, 0)) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("sendmmsg");
+      /* lose the line that failed rather than spin on it */
+      sent = 1;
+    }
+    i += sent;
+  }
+  batch->count = 0;
+}
+
+static void keep(struct msghdr *msg, uint64_t seq)
+{
+  size_t slot = seq % retransmit.count, i, length = 0;
+
+  for (i = 0; i < msg->msg_iovlen; ++i) {
+    memcpy(retransmit.slots + slot * retransmit.stride + length, msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len);
+    length += msg->msg_iov[i].iov_len;
+  }
+  retransmit.seqs[slot] = seq;
+  retransmit.lengths[slot] = length;
+}
+
+static void batch_add(int fd, struct batch *batch, struct ring *ring, uint64_t start, uint64_t end)
+{
+  struct msghdr *msg = &batch->msgs[batch->count].msg_hdr;
+  struct tee_header header;
+
+  msg->msg_iov = &batch->iovs[3 * batch->count];
+  msg->msg_iovlen = 0;
+  if (sequenced) {
+    header.type = TEE_DATA;
+    header.stream = stream_id;
+    header.seq = next_seq;
+    tee_header_encode(&header, batch->headers[batch->count]);
+    msg->msg_iov[0].iov_base = batch->headers[batch->count];
+    msg->msg_iov[0].iov_len = TEE_HEADER_SIZE;
+    msg->msg_iovlen = 1;
+  }
+  msg->msg_iovlen += ring_iov(ring, start, end, msg->msg_iov + msg->msg_iovlen);
+  if (retransmit.count) {
+    keep(msg, next_seq);
+  }
+  ++next_seq;
+  if (++batch->count == BATCH_LINES) {
+    batch_flush(fd, batch);
+  }
+}
+
+/* finds the lines in what was just read, memchr goes a word or a vector at a time.
+   without packing each line is sent as it is found, with packing a datagram is
+   sent once the next line would not fit */
+static void ring_scan(int fd, struct batch *batch, struct ring *ring, size_t pack)
+{
+  size_t offset, limit = pack ? pack : MAXLINE - (sequenced ? TEE_HEADER_SIZE : 0);
+  uint64_t length;
+  char *newline;
+
+  while (ring->scanned < ring->end) {
+    offset = ring->scanned % RING_SIZE;
+    length = ring->end - ring->scanned;
+    if (offset + length > RING_SIZE) {
+      length = RING_SIZE - offset;
+    }
+    if (ring->scanned + length > ring->line + limit) {
+      length = ring->line + limit - ring->scanned;
+    }
+    newline = memchr(ring->data + offset, '\n', length);
+    ring->scanned = newline ? ring->scanned + (newline - ring->data - offset) + 1 : ring->scanned + length;
+    if (!newline && ring->scanned - ring->line < limit) {
+      continue;
+    }
+    if (pack && ring->scanned - ring->start > pack) {
+      batch_add(fd, batch, ring, ring->start, ring->line);
+      ring->start = ring->line;
+    }
+    if (pack && ring->start == ring->line) {
+      ring->opened = microseconds();
+    }
+    ring->line = ring->scanned;
+    if (!pack || ring->line - ring->start == pack) {
+      batch_add(fd, batch, ring, ring->start, ring->line);
+      ring->start = ring->line;
+    }
+  }
+}
+
+/* answers the NAKs that have arrived without waiting for more */
+static void serve_naks(int fd)
+{
+  char buf[TEE_HEADER_SIZE + TEE_NAK_RANGES * TEE_NAK_RANGE_SIZE];
+  uint64_t first[TEE_NAK_RANGES], seq;
+  uint32_t count[TEE_NAK_RANGES];
+  struct tee_header header;
+  size_t i, ranges, slot;
+  ssize_t n;
+
+  while ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+    if (tee_header_decode(&header, buf, n) == -1 || header.type != TEE_NAK || header.stream != stream_id) {
+      continue;
+    }
+    ranges = tee_nak_decode(buf, n, first, count, TEE_NAK_RANGES);
+    for (i = 0; i < ranges; ++i) {
+      for (seq = first[i]; seq < first[i] + count[i] && seq < next_seq; ++seq) {
+        slot = seq % retransmit.count;
+        if (retransmit.seqs[slot] != seq || !retransmit.lengths[slot]) {
+          ++retransmit.expired;
+          continue;
+        }
+        sendto(fd, retransmit.slots + slot * retransmit.stride, retransmit.lengths[slot], MSG_DONTWAIT,
+            (struct sockaddr*)&serveraddr, serveraddrlen);
+        ++retransmit.resent;
+      }
+    }
+  }
+}
+
+/* moves length bytes from one fd to another, at least one of them a pipe */
+static int splice_all(int in, int out, size_t length, unsigned int flags)
+{
+  ssize_t n;
+
+  while (length) {
+    if ((n = splice(in, NULL, out, NULL, length, flags)) <= 0) {
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    length -= n;
+  }
+  return 0;
+}
+
+/* duplicates the stdin pipe with tee, stdout gets the copy and the socket the
+   original. tee only works between pipes, so a stdout that is a file or
+   terminal is fed through a pipe of our own */
+static int splice_stream(const char *url)
+{
+  struct endpoint endpoint;
+  struct stat st;
+  int fd, out = 1, through[2] = { -1, -1 };
+  ssize_t n;
+
+  if (fstat(0, &st) == -1 || !S_ISFIFO(st.st_mode)) {
+    fprintf(stderr, "-z needs stdin to be a pipe\n");
+    return 1;
+  }
+  if (endpoint_parse(&endpoint, url, SOCK_STREAM) || endpoint_is_shm(&endpoint)) {
+    fprintf(stderr, "Error: %s is not a tcp:// or unix:// endpoint\n", url);
+    return 1;
+  }
+  if ((fd = endpoint_open(&endpoint, 0, &connect)) < 0) {
+    fprintf(stderr, "Error connecting to %s: %s\n", url, strerror(errno));
+    return 1;
+  }
+  if (fstat(1, &st) == -1 || !S_ISFIFO(st.st_mode)) {
+    if (pipe(through) == -1) {
+      perror("pipe");
+      return 1;
+    }
+    out = through[1];
+    fcntl(through[1], F_SETPIPE_SZ, SPLICE_SIZE);
+  }
+  /* best effort, an unprivileged process is held to /proc/sys/fs/pipe-max-size */
+  fcntl(0, F_SETPIPE_SZ, SPLICE_SIZE);
+  fcntl(out, F_SETPIPE_SZ, SPLICE_SIZE);
+
+  while ((n = tee(0, out, SPLICE_SIZE, 0)) != 0) {
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("tee");
+      return 1;
+    }
+    if (through[0] != -1 && splice_all(through[0], 1, n, SPLICE_F_MOVE) == -1) {
+      perror("splice to stdout");
+      return 1;
+    }
+    /* tee left the bytes in stdin, this consumes them */
+    if (splice_all(0, fd, n, SPLICE_F_MOVE | SPLICE_F_MORE) == -1) {
+      perror("splice to socket");
+      return 1;
+    }
+  }
+  close(fd);
+  return 0;
+}
+
+static int write_all(int fd, struct iovec *iov, size_t count)
+{
+  ssize_t n;
+
+  while (count) {
+    if ((n = writev(fd, iov, count)) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    while (count && (size_t) n >= iov->iov_len) {
+      n -= iov->iov_len;
+      ++iov;
+      --count;
+    }
+    if (count) {
+      iov->iov_base = (char *) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
 /* main driver function */
 int main(int argc, char **argv)
 {
-  char *host, *port, *progname = argv[0], buffer[MAXLINE];
+  char *host, *port, *progname = argv[0];
   struct options options;
-  ssize_t n = 1, c = 0, i;
-  int clientfd, error;
+  struct ring *ring;
+  struct batch *batch;
+  struct iovec echo[2];
+  struct pollfd input[2];
+  struct timespec timeout;
+  size_t i, offset, space, pack;
+  uint64_t waited;
+  ssize_t n;
+  int clientfd, error, ready;
 
   memset(&options, 0, sizeof(struct options));
   options.argc = argc - 1;
   options.argv = argv + 1;
+  options.deadline = 1000;
 
   error = optparse(&options);
 
+  if (!error && options.splice && options.argc == 0) {
+    return splice_stream(options.splice);
+  }
   if (error || options.argc != 2) {
-    fprintf(stderr, usage, progname);
+    fprintf(stderr, usage, progname, progname);
     return error ? error - 1 : 0;
   }
 
+  if (options.pack > MAX_PACK) {
+    fprintf(stderr, "Datagrams can hold at most %d bytes\n", MAX_PACK);
+    return 1;
+  }
+  sequenced = options.sequenced;
+  stream_id = options.stream ? options.stream : (uint32_t) getpid() ^ (uint32_t) microseconds();
+  /* -m is the whole datagram, the header comes out of it */
+  if (options.pack && sequenced && options.pack <= TEE_HEADER_SIZE) {
+    fprintf(stderr, "Sequenced datagrams need more than %d bytes\n", TEE_HEADER_SIZE);
+    return 1;
+  }
+  pack = options.pack && sequenced ? options.pack - TEE_HEADER_SIZE : options.pack;
+
   host = options.argv[0];
   port = options.argv[1];
 
@@ -89,27 +417,102 @@ int main(int argc, char **argv)
     return 1;
   }
 
+  ring = calloc(1, sizeof(*ring));
+  batch = calloc(1, sizeof(*batch));
+  if (ring == NULL || batch == NULL) {
+    fprintf(stderr, "Error allocating buffers\n");
+    return 1;
+  }
+  for (i = 0; i < BATCH_LINES; ++i) {
+    batch->msgs[i].msg_hdr.msg_name = &serveraddr;
+    batch->msgs[i].msg_hdr.msg_namelen = serveraddrlen;
+  }
+  if (options.retransmit) {
+    retransmit.count = options.retransmit;
+    retransmit.stride = TEE_HEADER_SIZE + (pack ? pack : MAXLINE);
+    retransmit.slots = malloc(retransmit.count * retransmit.stride);
+    retransmit.seqs = calloc(retransmit.count, sizeof(*retransmit.seqs));
+    retransmit.lengths = calloc(retransmit.count, sizeof(*retransmit.lengths));
+    if (!retransmit.slots || !retransmit.seqs || !retransmit.lengths) {
+      fprintf(stderr, "Error allocating the retransmit ring\n");
+      return 1;
+    }
+  }
+
+  input[0].fd = 0;
+  input[0].events = POLLIN;
+  input[1].fd = clientfd;
+  input[1].events = POLLIN;
   while (1) {
-    n = read(0, buffer + c, MAXLINE - c);
-    if (n == 0) {
-      exit(0);
-    }
-    c += n;
-    for (i = 0; i < c; ) {
-      if (buffer[i++] == '\n') {
-        write(1, buffer, i);
-        sendto(clientfd, buffer, i, 0, (struct sockaddr*)&serveraddr, serveraddrlen);
-        memmove(buffer, buffer + i, c - i);
-        c -= i;
-        i = 0;
+    /* without recovery or a packed datagram waiting, stdin is simply read */
+    if (retransmit.count || ring->line > ring->start) {
+      /* a packed datagram waits for more lines until its deadline */
+      waited = ring->line > ring->start ? microseconds() - ring->opened : 0;
+      if (ring->line > ring->start && waited < options.deadline) {
+        timeout.tv_sec = (options.deadline - waited) / 1000000;
+        timeout.tv_nsec = (options.deadline - waited) % 1000000 * 1000;
+      }
+      if (ring->line > ring->start && waited >= options.deadline) {
+        ready = 0;
+      } else if ((ready = ppoll(input, retransmit.count ? 2 : 1, ring->line > ring->start ? &timeout : NULL, NULL)) == -1) {
+        continue;
+      }
+      if (retransmit.count && input[1].revents) {
+        serve_naks(clientfd);
       }
+      if (ready == 0) {
+        batch_add(clientfd, batch, ring, ring->start, ring->line);
+        ring->start = ring->line;
+        batch_flush(clientfd, batch);
+        continue;
+      }
+      if (!input[0].revents) {
+        continue;
+      }
+    }
+    /* everything before start has been sent, and everything read echoed */
+    offset = ring->end % RING_SIZE;
+    space = RING_SIZE - (ring->end - ring->start);
+    if (offset + space > RING_SIZE) {
+      space = RING_SIZE - offset;
+    }
+    n = read(0, ring->data + offset, space);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    /* the whole read is echoed with one write and its lines sent with one sendmmsg */
+    if (write_all(1, echo, ring_iov(ring, ring->end, ring->end + n, echo)) == -1) {
+      perror("write");
+      return 1;
     }
-    if (c == MAXLINE) {
-      fprintf(stderr, "Line too long, dropping %d characters\n", MAXLINE);
+    ring->end += n;
+    ring_scan(clientfd, batch, ring, pack);
+    batch_flush(clientfd, batch);
+  }
+  if (n == -1) {
+    perror("read");
+  }
+  /* the last packed lines, then a last line without a newline */
+  if (ring->start < ring->line) {
+    batch_add(clientfd, batch, ring, ring->start, ring->line);
+  }
+  if (ring->line < ring->end) {
+    batch_add(clientfd, batch, ring, ring->line, ring->end);
+  }
+  batch_flush(clientfd, batch);
+
+  if (retransmit.count) {
+    timeout.tv_sec = RECOVERY_LINGER / 1000000;
+    timeout.tv_nsec = RECOVERY_LINGER % 1000000 * 1000;
+    while (ppoll(&input[1], 1, &timeout, NULL) > 0) {
+      serve_naks(clientfd);
     }
+    fprintf(stderr, "Resent %lu datagrams, %lu were no longer held\n", retransmit.resent, retransmit.expired);
   }
 
   close(clientfd);
-  return 0;
+  return n == -1;
 }
-
@@ -0,0 +1,166 @@
+#include <endian.h>
+#include <string.h>
+#include "tee-sequence.h"
+
+#define BIT(stream, seq) ((stream)->bitmap[((seq) % TEE_WINDOW) / 64] & (1ULL << ((seq) % 64)))
+#define SET(stream, seq) ((stream)->bitmap[((seq) % TEE_WINDOW) / 64] |= (1ULL << ((seq) % 64)))
+#define CLEAR(stream, seq) ((stream)->bitmap[((seq) % TEE_WINDOW) / 64] &= ~(1ULL << ((seq) % 64)))
+
+void tee_header_encode(const struct tee_header *header, char *buf)
+{
+  uint16_t magic = htobe16(TEE_MAGIC);
+  uint32_t stream = htobe32(header->stream);
+  uint64_t seq = htobe64(header->seq);
+
+  memcpy(buf, &magic, 2);
+  buf[2] = TEE_VERSION;
+  buf[3] = header->type;
+  memcpy(buf + 4, &stream, 4);
+  memcpy(buf + 8, &seq, 8);
+}
+
+/* returns 0 if the datagram starts with a header, -1 if it is plain lines */
+int tee_header_decode(struct tee_header *header, const char *buf, size_t length)
+{
+  uint16_t magic;
+  uint32_t stream;
+  uint64_t seq;
+
+  if (length < TEE_HEADER_SIZE) {
+    return -1;
+  }
+  memcpy(&magic, buf, 2);
+  if (be16toh(magic) != TEE_MAGIC || buf[2] != TEE_VERSION) {
+    return -1;
+  }
+  memcpy(&stream, buf + 4, 4);
+  memcpy(&seq, buf + 8, 8);
+  header->type = buf[3];
+  header->stream = be32toh(stream);
+  header->seq = be64toh(seq);
+  return 0;
+}
+
+/* starts tracking a sender at the first sequence number seen from it */
+void tee_stream_init(struct tee_stream *stream, uint32_t id, uint64_t seq)
+{
+  memset(stream, 0, sizeof(*stream));
+  stream->id = id;
+  stream->base = stream->next = seq;
+}
+
+static void nak(struct tee_stream *stream, uint64_t first, uint64_t count)
+{
+  if (count > TEE_WINDOW) {
+    /* the start of a gap this long is out of the window before it could arrive */
+    first += count - TEE_WINDOW;
+    count = TEE_WINDOW;
+  }
+  if (stream->naks < TEE_NAK_RANGES) {
+    stream->nak_first[stream->naks] = first;
+    stream->nak_count[stream->naks++] = count;
+  }
+}
+
+/* records that seq has arrived, returns 1 if its lines are new and 0 if it is
+   a duplicate or too late to tell */
+int tee_stream_receive(struct tee_stream *stream, uint64_t seq)
+{
+  uint64_t p;
+
+  if (seq >= stream->next) {
+    if (seq > stream->next) {
+      nak(stream, stream->next, seq - stream->next);
+    }
+    if (seq - stream->next >= TEE_WINDOW) {
+      /* everything tracked so far leaves the window, start it again */
+      stream->lost += stream->missing + (seq - TEE_WINDOW + 1 - stream->next);
+      stream->missing = 0;
+      memset(stream->bitmap, 0, sizeof(stream->bitmap));
+      stream->base = stream->next = seq - TEE_WINDOW + 1;
+    }
+    for (p = stream->next; p <= seq; ++p) {
+      if (p >= stream->base + TEE_WINDOW && !BIT(stream, p - TEE_WINDOW)) {
+        ++stream->lost;
+        --stream->missing;
+      }
+      CLEAR(stream, p);
+      ++stream->missing;
+    }
+    SET(stream, seq);
+    --stream->missing;
+    stream->next = seq + 1;
+    ++stream->received;
+    return 1;
+  }
+  if (seq < stream->base || stream->next - seq > TEE_WINDOW) {
+    ++stream->late;
+    return 0;
+  }
+  if (BIT(stream, seq)) {
+    ++stream->duplicates;
+    return 0;
+  }
+  SET(stream, seq);
+  --stream->missing;
+  ++stream->recovered;
+  ++stream->received;
+  return 1;
+}
+
+/* NAKs everything still missing in the window again, for when the resent
+   datagrams were lost as well */
+void tee_stream_renak(struct tee_stream *stream)
+{
+  uint64_t seq = stream->next - stream->base > TEE_WINDOW ? stream->next - TEE_WINDOW : stream->base, first;
+
+  stream->naks = 0;
+  while (seq < stream->next && stream->naks < TEE_NAK_RANGES) {
+    if (seq % 64 == 0 && seq + 64 <= stream->next && stream->bitmap[(seq % TEE_WINDOW) / 64] == ~0ULL) {
+      seq += 64;
+      continue;
+    }
+    if (BIT(stream, seq)) {
+      ++seq;
+      continue;
+    }
+    for (first = seq; seq < stream->next && !BIT(stream, seq); ++seq) ;
+    nak(stream, first, seq - first);
+  }
+}
+
+/* writes a NAK for the gaps seen since the last one, returns its length */
+size_t tee_nak_encode(struct tee_stream *stream, char *buf)
+{
+  struct tee_header header;
+  uint64_t first;
+  uint32_t count;
+  size_t i, length = TEE_HEADER_SIZE;
+
+  header.type = TEE_NAK;
+  header.stream = stream->id;
+  header.seq = 0;
+  tee_header_encode(&header, buf);
+  for (i = 0; i < stream->naks; ++i, length += TEE_NAK_RANGE_SIZE) {
+    first = htobe64(stream->nak_first[i]);
+    count = htobe32(stream->nak_count[i]);
+    memcpy(buf + length, &first, 8);
+    memcpy(buf + length + 8, &count, 4);
+  }
+  stream->naks = 0;
+  return length;
+}
+
+/* reads up to max ranges from a NAK, returns how many there were */
+size_t tee_nak_decode(const char *buf, size_t length, uint64_t *first, uint32_t *count, size_t max)
+{
+  size_t i;
+
+  for (i = 0; i < max && TEE_HEADER_SIZE + (i + 1) * TEE_NAK_RANGE_SIZE <= length; ++i) {
+    memcpy(&first[i], buf + TEE_HEADER_SIZE + i * TEE_NAK_RANGE_SIZE, 8);
+    memcpy(&count[i], buf + TEE_HEADER_SIZE + i * TEE_NAK_RANGE_SIZE + 8, 4);
+    first[i] = be64toh(first[i]);
+    count[i] = be32toh(count[i]);
+  }
+  return i;
+}
@@ -0,0 +1,54 @@
+#ifndef TEE_SEQUENCE_H
+#define TEE_SEQUENCE_H
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+/* with sequencing, tee-client starts every datagram with a header
+ *   uint16_t magic, uint8_t version, uint8_t type, uint32_t stream, uint64_t seq
+ * in network byte order. data datagrams carry lines after it, NAKs sent back
+ * by tee-server carry up to TEE_NAK_RANGES of
+ *   uint64_t first, uint32_t count
+ * naming the sequence numbers it is missing. the magic starts with a byte that
+ * can't begin a line of text, so plain datagrams are still told apart
+ */
+#define TEE_MAGIC 0xfe53
+#define TEE_VERSION 1
+#define TEE_DATA 1
+#define TEE_NAK 2
+#define TEE_HEADER_SIZE 16
+#define TEE_NAK_RANGE_SIZE 12
+#define TEE_NAK_RANGES 64
+/* how many sequence numbers behind the highest one are tracked */
+#define TEE_WINDOW 65536
+
+struct tee_header {
+  uint8_t type;
+  uint32_t stream;
+  uint64_t seq;
+};
+
+/* loss tracking for one sender, a bit per sequence number in the window is set
+   once it has arrived, anything still missing when it leaves the window is lost */
+struct tee_stream {
+  uint32_t id;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  uint64_t base, next;
+  uint64_t bitmap[TEE_WINDOW / 64];
+  uint64_t received, missing, lost, recovered, duplicates, late;
+  uint64_t reported_received, reported_lost;
+  /* gaps waiting to be NAKed */
+  uint64_t nak_first[TEE_NAK_RANGES];
+  uint32_t nak_count[TEE_NAK_RANGES];
+  size_t naks;
+};
+
+void tee_header_encode(const struct tee_header *header, char *buf);
+int tee_header_decode(struct tee_header *header, const char *buf, size_t length);
+void tee_stream_init(struct tee_stream *stream, uint32_t id, uint64_t seq);
+int tee_stream_receive(struct tee_stream *stream, uint64_t seq);
+void tee_stream_renak(struct tee_stream *stream);
+size_t tee_nak_encode(struct tee_stream *stream, char *buf);
+size_t tee_nak_decode(const char *buf, size_t length, uint64_t *first, uint32_t *count, size_t max);
+#endif/*TEE_SEQUENCE_H*/
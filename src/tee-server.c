@@ -1,8 +1,13 @@
+#define _GNU_SOURCE
 #define MAIN
+#include <errno.h>
+#include <limits.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <signal.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,20 +16,73 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include "fanout.h"
+#include "segment.h"
+#include "tee-sequence.h"
 #include "traffic-shared.h"
 #include "udp-shared.h"
-#define MAXLINE 4096
+#define MAXLINE 65536
+#define MAX_SUBSCRIBERS 64
+/* senders with sequencing tracked at once, the oldest is forgotten for a new one */
+#define MAX_STREAMS 64
+/* how often, in microseconds, datagrams still missing are NAKed again */
+#define NAK_INTERVAL 20000
+/* overflow drops are reported at most this often, in microseconds */
+#define REPORT_INTERVAL 1000000
 
 struct options {
   int argc;
   char **argv;
+
+  size_t slots, flush_bytes, flush_us, depth, print_us, max_packet_size;
+  int rcvbuf, nak, direct;
+  char *segment_prefix;
+  size_t segment_size, segment_age;
+  char *subscribers[MAX_SUBSCRIBERS];
+  int block[MAX_SUBSCRIBERS];
+  size_t subscriber_count;
+};
+
+/* datagrams are received straight into a pool of slots, recvmmsg fills
+   the free slots and the filled ones go to stdout in one writev, or
+   into the segment buffer as they arrive when writing segments */
+struct pool {
+  char *buffers;
+  size_t size;
+  struct mmsghdr *msgs;
+  struct iovec *iovs;
+  struct iovec *out;
+  char *control;
+  struct sockaddr_storage *names;
+  size_t slots, used, bytes;
+  uint64_t oldest;
 };
 
+#define CONTROL_SIZE CMSG_SPACE(sizeof(uint32_t))
+
 char* app_type = "server";
 
+static volatile sig_atomic_t stopping;
+
 static const char usage[] =
-  "usage: %s PORT\n"
-  "  -h          : Print help and exit\n";
+  "usage: %s [-hkD] [-a AGE] [-m SIZE] [-n SLOTS] [-o BYTES] [-p PRINT] [-q DEPTH] [-r RCVBUF] [-s SUBSCRIBER] [-S SUBSCRIBER] [-t FLUSH] [-w PREFIX] [-W SIZE] PORT\n"
+  "  -a=0        : Microseconds before a segment is rotated, 0 rotates by size only\n"
+  "  -D          : Write segments with O_DIRECT\n"
+  "  -h          : Print help and exit\n"
+  "  -k          : Send NAKs for sequenced datagrams that went missing, so a tee-client -r resends them\n"
+  "  -m=4096     : Maximum datagram size, a datagram may pack several whole lines\n"
+  "  -n=1024     : Datagrams buffered before they are written out, at most IOV_MAX\n"
+  "  -o=262144   : Buffered bytes that trigger a write\n"
+  "  -p=0        : Microseconds between subscriber and sequence loss reports on stderr, 0 for none\n"
+  "  -q=4096     : Datagrams each subscriber may have queued\n"
+  "  -r=0        : Receive socket buffer size, 0 keeps the system default\n"
+  "  -s          : Also relay to SUBSCRIBER, dropping its oldest datagrams when it falls behind\n"
+  "  -S          : Also relay to SUBSCRIBER, holding up the receive when it falls behind\n"
+  "  -t=50000    : Microseconds a datagram may wait to be written out\n"
+  "  -w          : Write to segment files PREFIX.000001 and on, each with an index PREFIX.000001.idx, instead of stdout\n"
+  "  -W=67108864 : Bytes preallocated for each segment, it is rotated when full\n"
+  "SUBSCRIBER is udp://HOST:PORT, udp6://[HOST]:PORT, unixgram://PATH, file://PATH or pipe://COMMAND\n"
+  "Datagrams dropped because the receive queue overflowed are reported on stderr\n";
 
 static int optparse(struct options *options)
 {
@@ -33,6 +91,27 @@ static int optparse(struct options *options)
 
   while (options->argc >= 2 && options->argv[0][0] == '-') {
     switch(options->argv[0][++i]) {
+    case 'a': options->segment_age = atoll(options->argv[n++]); break;
+    case 'D': options->direct = 1; break;
+    case 'k': options->nak = 1; break;
+    case 'm': options->max_packet_size = atoll(options->argv[n++]); break;
+    case 'n': options->slots = atoll(options->argv[n++]); break;
+    case 'o': options->flush_bytes = atoll(options->argv[n++]); break;
+    case 'p': options->print_us = atoll(options->argv[n++]); break;
+    case 'q': options->depth = atoll(options->argv[n++]); break;
+    case 'r': options->rcvbuf = atoi(options->argv[n++]); break;
+    case 's':
+    case 'S':
+      if (options->subscriber_count == MAX_SUBSCRIBERS) {
+        fprintf(stderr, "At most %d subscribers\n", MAX_SUBSCRIBERS);
+        return 2;
+      }
+      options->block[options->subscriber_count] = options->argv[0][i] == 'S';
+      options->subscribers[options->subscriber_count++] = options->argv[n++];
+      break;
+    case 't': options->flush_us = atoll(options->argv[n++]); break;
+    case 'w': options->segment_prefix = options->argv[n++]; break;
+    case 'W': options->segment_size = atoll(options->argv[n++]); break;
     case 'h': return 1;
     case '-':
       options->argc -= n;
@@ -52,19 +131,256 @@ static int optparse(struct options *options)
   return 0;
 }
 
+static int pool_init(struct pool *pool, size_t slots, size_t size)
+{
+  size_t i;
+
+  memset(pool, 0, sizeof(*pool));
+  pool->slots = slots;
+  pool->size = size;
+  pool->buffers = malloc(slots * size);
+  pool->msgs = calloc(slots, sizeof(*pool->msgs));
+  pool->iovs = calloc(slots, sizeof(*pool->iovs));
+  pool->out = calloc(slots, sizeof(*pool->out));
+  pool->control = calloc(slots, CONTROL_SIZE);
+  pool->names = calloc(slots, sizeof(*pool->names));
+  if (!pool->buffers || !pool->msgs || !pool->iovs || !pool->out || !pool->control || !pool->names) {
+    return -1;
+  }
+  for (i = 0; i < slots; ++i) {
+    pool->iovs[i].iov_base = pool->buffers + i * size;
+    pool->iovs[i].iov_len = size;
+    pool->out[i].iov_base = pool->iovs[i].iov_base;
+    pool->msgs[i].msg_hdr.msg_iov = &pool->iovs[i];
+    pool->msgs[i].msg_hdr.msg_iovlen = 1;
+    pool->msgs[i].msg_hdr.msg_control = pool->control + i * CONTROL_SIZE;
+    pool->msgs[i].msg_hdr.msg_name = &pool->names[i];
+  }
+  return 0;
+}
+
+static void pool_reset(struct pool *pool)
+{
+  size_t i;
+
+  for (i = 0; i < pool->used; ++i) {
+    pool->out[i].iov_base = pool->iovs[i].iov_base;
+  }
+  pool->used = 0;
+  pool->bytes = 0;
+}
+
+/* writes out the filled slots, returns -1 if stdout fails */
+static int pool_flush(struct pool *pool)
+{
+  struct iovec *iov = pool->out;
+  size_t count = pool->used;
+  ssize_t n;
+
+  while (count) {
+    n = writev(1, iov, count);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    /* a pipe may take less than everything */
+    while (count && (size_t) n >= iov->iov_len) {
+      n -= iov->iov_len;
+      ++iov;
+      --count;
+    }
+    if (count) {
+      iov->iov_base = (char *) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  pool_reset(pool);
+  return 0;
+}
+
+/* the slots were copied into the segment buffer as they arrived */
+static int pool_flush_segment(struct pool *pool, struct segment_sink *sink)
+{
+  pool_reset(pool);
+  return segment_flush(sink);
+}
+
+/* the count of datagrams the socket has dropped so far, from SO_RXQ_OVFL */
+static uint32_t rxq_drops(struct msghdr *msg)
+{
+  struct cmsghdr *cmsg;
+  uint32_t drops = 0;
+
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+      memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+    }
+  }
+  return drops;
+}
+
+/* a datagram holds one or more whole lines, subscribers are given one line at a time */
+static void unpack(struct fanout *fanout, const char *data, size_t length)
+{
+  const char *end = data + length, *newline;
+
+  while (fanout->count && data < end) {
+    newline = memchr(data, '\n', end - data);
+    newline = newline ? newline + 1 : end;
+    fanout_push(fanout, data, newline - data);
+    data = newline;
+  }
+}
+
+struct streams {
+  struct tee_stream *streams[MAX_STREAMS];
+  size_t count, next;
+};
+
+static struct tee_stream *find_stream(struct streams *streams, const struct tee_header *header,
+    const struct sockaddr_storage *addr, socklen_t addrlen)
+{
+  struct tee_stream *stream;
+  size_t i;
+
+  for (i = 0; i < streams->count; ++i) {
+    if (streams->streams[i]->id == header->stream) {
+      stream = streams->streams[i];
+      break;
+    }
+  }
+  if (i == streams->count) {
+    if (streams->count < MAX_STREAMS) {
+      if ((stream = malloc(sizeof(*stream))) == NULL) {
+        return NULL;
+      }
+      streams->streams[streams->count++] = stream;
+    } else {
+      stream = streams->streams[streams->next++ % MAX_STREAMS];
+    }
+    tee_stream_init(stream, header->stream, header->seq);
+  }
+  /* NAKs go back to wherever the stream last came from */
+  memcpy(&stream->addr, addr, addrlen);
+  stream->addrlen = addrlen;
+  return stream;
+}
+
+/* strips the sequencing header, returns how much of the datagram is new lines */
+static size_t sequence(struct streams *streams, char **data, size_t length, struct msghdr *msg)
+{
+  struct tee_header header;
+  struct tee_stream *stream;
+
+  if (tee_header_decode(&header, *data, length) == -1) {
+    return length;
+  }
+  if (header.type != TEE_DATA) {
+    return 0;
+  }
+  *data += TEE_HEADER_SIZE;
+  stream = find_stream(streams, &header, msg->msg_name, msg->msg_namelen);
+  return !stream || tee_stream_receive(stream, header.seq) ? length - TEE_HEADER_SIZE : 0;
+}
+
+static void send_naks(int fd, struct streams *streams, int again)
+{
+  char buf[TEE_HEADER_SIZE + TEE_NAK_RANGES * TEE_NAK_RANGE_SIZE];
+  size_t i, length;
+
+  for (i = 0; i < streams->count; ++i) {
+    if (again && streams->streams[i]->missing) {
+      tee_stream_renak(streams->streams[i]);
+    }
+    if (streams->streams[i]->naks) {
+      length = tee_nak_encode(streams->streams[i], buf);
+      sendto(fd, buf, length, MSG_DONTWAIT, (struct sockaddr *) &streams->streams[i]->addr, streams->streams[i]->addrlen);
+    }
+  }
+}
+
+static void report_streams(struct streams *streams, FILE *out)
+{
+  struct tee_stream *s;
+  uint64_t received, lost;
+  size_t i;
+
+  for (i = 0; i < streams->count; ++i) {
+    s = streams->streams[i];
+    received = s->received - s->reported_received;
+    lost = s->lost - s->reported_lost;
+    fprintf(out, "stream %u: received %lu, lost %lu, loss %.3f%%, missing %lu, recovered %lu, duplicates %lu, late %lu\n",
+        s->id, received, lost, received + lost ? lost * 100.0 / (received + lost) : 0.0,
+        s->missing, s->recovered, s->duplicates, s->late);
+    s->reported_received = s->received;
+    s->reported_lost = s->lost;
+  }
+}
+
+static void set_rcvbuf(int fd, int size)
+{
+  socklen_t len = sizeof(int);
+  int actual;
+
+  /* SO_RCVBUFFORCE passes net.core.rmem_max when privileged */
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) == -1 &&
+      setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) == -1) {
+    fprintf(stderr, "Error setting socket option SO_RCVBUF on %d - continuing\n", fd);
+    return;
+  }
+  /* the kernel doubles the size for its bookkeeping */
+  if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &actual, &len) == 0 && actual < 2 * size) {
+    fprintf(stderr, "Receive buffer capped at %d bytes, raise net.core.rmem_max for more\n", actual / 2);
+  }
+}
+
+static void stop(int signum)
+{
+  stopping = 1;
+}
+
+/* finishes the open segment on SIGINT or SIGTERM, so it is not left padded out */
+static void stop_on_signals(void)
+{
+  struct sigaction action;
+
+  memset(&action, 0, sizeof(action));
+  /* no SA_RESTART, the blocked receive returns EINTR */
+  action.sa_handler = stop;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+}
+
 /* driver function */
 int main(int argc, char **argv)
 {
-  char *portstring, *progname = argv[0], buffer[MAXLINE];
+  char *portstring, *progname = argv[0];
   struct options options;
-  struct sockaddr_in clientaddr;
-  int error, listenfd;
-  ssize_t n;
-  socklen_t socklen;
+  struct pool pool;
+  struct fanout fanout;
+  struct streams streams;
+  struct segment_sink sink;
+  char *data;
+  size_t length;
+  struct timeval timeout;
+  int error, listenfd, option_true = 1, again;
+  uint32_t drops = 0, reported = 0;
+  uint64_t now, last_report = 0, last_print, last_nak = 0;
+  size_t i;
+  int n;
 
   memset(&options, 0, sizeof(struct options));
+  memset(&streams, 0, sizeof(streams));
   options.argc = argc - 1;
   options.argv = argv + 1;
+  options.slots = 1024;
+  options.flush_bytes = 262144;
+  options.flush_us = 50000;
+  options.depth = 4096;
+  options.max_packet_size = 4096;
+  options.segment_size = 67108864;
 
   error = optparse(&options);
 
@@ -72,6 +388,27 @@ int main(int argc, char **argv)
     fprintf(stderr, usage, progname);
     return error ? error - 1 : 0;
   }
+  if (options.max_packet_size < 1 || options.max_packet_size > MAXLINE) {
+    fprintf(stderr, "Error : The maximum datagram size must be between 1 and %d\n", MAXLINE);
+    return 1;
+  }
+  if (options.slots < 1 || options.slots > IOV_MAX) {
+    fprintf(stderr, "Error : The number of buffered datagrams must be between 1 and %d\n", IOV_MAX);
+    return 1;
+  }
+  if (options.depth < 1) {
+    fprintf(stderr, "Error : Each subscriber must be able to queue at least 1 datagram\n");
+    return 1;
+  }
+
+  if (options.segment_prefix && segment_open(&sink, options.segment_prefix, options.segment_size,
+        options.segment_age, options.direct) == -1) {
+    fprintf(stderr, "Error : Cannot write segments %s: %s\n", options.segment_prefix, strerror(errno));
+    return 1;
+  }
+  if (options.segment_prefix) {
+    stop_on_signals();
+  }
 
   portstring = options.argv[0];
   listenfd = open_socketfd(NULL, portstring, AI_PASSIVE, SOCK_DGRAM, &bind);
@@ -80,9 +417,99 @@ int main(int argc, char **argv)
     fprintf(stderr, "Error : Cannot listen to socket %s with error %d\n", portstring, listenfd);
     return 1;
   }
+  if (pool_init(&pool, options.slots, options.max_packet_size) == -1) {
+    fprintf(stderr, "Error : Cannot allocate %lu receive buffers\n", options.slots);
+    return 1;
+  }
 
-  while(1) {
-    n = recvfrom(listenfd, buffer, MAXLINE, 0, (struct sockaddr*)&clientaddr, &socklen);
-    write(1, buffer, n);
+  fanout_init(&fanout, options.max_packet_size, options.depth);
+  for (i = 0; i < options.subscriber_count; ++i) {
+    if (fanout_add(&fanout, options.subscribers[i], options.block[i]) == -1) {
+      fprintf(stderr, "Error : Cannot open subscriber %s: %s\n", options.subscribers[i], strerror(errno));
+      return 1;
+    }
   }
+  if (fanout_start(&fanout) == -1) {
+    fprintf(stderr, "Error : Cannot start subscriber threads: %s\n", strerror(errno));
+    return 1;
+  }
+
+  if (options.rcvbuf) {
+    set_rcvbuf(listenfd, options.rcvbuf);
+  }
+  if (setsockopt(listenfd, SOL_SOCKET, SO_RXQ_OVFL, &option_true, sizeof(option_true)) == -1) {
+    fprintf(stderr, "Error setting socket option SO_RXQ_OVFL on %d - continuing\n", listenfd);
+  }
+  /* wakes the receive up so a quiet sender's lines are not held back */
+  timeout.tv_sec = options.flush_us / 1000000;
+  timeout.tv_usec = options.flush_us % 1000000;
+  if (setsockopt(listenfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1) {
+    fprintf(stderr, "Error setting socket option SO_RCVTIMEO on %d - continuing\n", listenfd);
+  }
+
+  last_print = microseconds();
+  while(!stopping) {
+    for (i = pool.used; i < pool.slots; ++i) {
+      pool.msgs[i].msg_hdr.msg_controllen = CONTROL_SIZE;
+      pool.msgs[i].msg_hdr.msg_namelen = sizeof(*pool.names);
+    }
+    /* blocks for the first datagram only, then takes whatever else is queued */
+    n = recvmmsg(listenfd, pool.msgs + pool.used, pool.slots - pool.used, MSG_WAITFORONE, NULL);
+    now = microseconds();
+    if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      perror("recvmmsg");
+      return 1;
+    }
+    if (n > 0 && !pool.used) {
+      pool.oldest = now;
+    }
+    for (i = pool.used; n > 0 && i < pool.used + n; ++i) {
+      data = pool.iovs[i].iov_base;
+      length = sequence(&streams, &data, pool.msgs[i].msg_len, &pool.msgs[i].msg_hdr);
+      pool.out[i].iov_base = data;
+      pool.out[i].iov_len = length;
+      pool.bytes += length;
+      if (pool.msgs[i].msg_hdr.msg_controllen) {
+        drops = rxq_drops(&pool.msgs[i].msg_hdr);
+      }
+      if (options.segment_prefix && length && segment_append(&sink, data, length, now) == -1) {
+        perror("segment");
+        return 1;
+      }
+      unpack(&fanout, data, length);
+    }
+    if (n > 0) {
+      fanout_publish(&fanout);
+    }
+    if (options.nak) {
+      again = now - last_nak >= NAK_INTERVAL;
+      send_naks(listenfd, &streams, again);
+      last_nak = again ? now : last_nak;
+    }
+    pool.used = i;
+
+    if (pool.used && (pool.used == pool.slots || pool.bytes >= options.flush_bytes ||
+        now - pool.oldest >= options.flush_us) &&
+        (options.segment_prefix ? pool_flush_segment(&pool, &sink) : pool_flush(&pool)) == -1) {
+      perror(options.segment_prefix ? "segment" : "writev");
+      return 1;
+    }
+    if (drops != reported && now - last_report >= REPORT_INTERVAL) {
+      fprintf(stderr, "%lu %s: receive queue overflowed, %u datagrams dropped, %u in total\n",
+          now, app_type, drops - reported, drops);
+      reported = drops;
+      last_report = now;
+    }
+    if (options.print_us && now - last_print >= options.print_us) {
+      fanout_report(&fanout, stderr, now - last_print);
+      report_streams(&streams, stderr);
+      last_print = now;
+    }
+  }
+  pool_reset(&pool);
+  if (options.segment_prefix && segment_close(&sink) == -1) {
+    perror("segment");
+    return 1;
+  }
+  return 0;
 }
@@ -0,0 +1,423 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "template.h"
+
+/* widest rendering of a uint64_t */
+#define NUMBER_LENGTH 20
+
+void rng_seed(struct rng *rng, uint64_t seed)
+{
+  /* splitmix64 so that nearby seeds give unrelated streams, and never zero */
+  seed += 0x9e3779b97f4a7c15ULL;
+  seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebULL;
+  rng->state = (seed ^ (seed >> 31)) | 1;
+}
+
+uint64_t rng_next(struct rng *rng)
+{
+  rng->state ^= rng->state >> 12;
+  rng->state ^= rng->state << 25;
+  rng->state ^= rng->state >> 27;
+  return rng->state * 0x2545f4914f6cdd1dULL;
+}
+
+/* uniform in [0, 1) */
+double rng_double(struct rng *rng)
+{
+  return (rng_next(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* log1p(x) / x and expm1(x) / x, both 1 in the limit of x going to 0 */
+static double helper1(double x)
+{
+  return fabs(x) > 1e-8 ? log1p(x) / x : 1 - x / 2;
+}
+
+static double helper2(double x)
+{
+  return fabs(x) > 1e-8 ? expm1(x) / x : 1 + x / 2;
+}
+
+static double zipf_h(const struct zipf *zipf, double x)
+{
+  return exp(-zipf->s * log(x));
+}
+
+static double zipf_h_integral(const struct zipf *zipf, double x)
+{
+  double log_x = log(x);
+  return helper2((1 - zipf->s) * log_x) * log_x;
+}
+
+static double zipf_h_integral_inverse(const struct zipf *zipf, double x)
+{
+  double t = x * (1 - zipf->s);
+  if (t < -1) {
+    t = -1;
+  }
+  return exp(helper1(t) * x);
+}
+
+/* Hormann and Derflinger, rejection-inversion to sample from monotone
+ * discrete distributions
+ */
+void zipf_init(struct zipf *zipf, uint64_t n, double s)
+{
+  zipf->n = n ? n : 1;
+  zipf->s = s;
+  zipf->h_x1 = zipf_h_integral(zipf, 1.5) - 1;
+  zipf->h_n = zipf_h_integral(zipf, zipf->n + 0.5);
+  zipf->threshold = 2 - zipf_h_integral_inverse(zipf, zipf_h_integral(zipf, 2.5) - zipf_h(zipf, 2));
+}
+
+/* rank 0 is the most popular key */
+uint64_t zipf_next(const struct zipf *zipf, struct rng *rng)
+{
+  double u, x;
+  uint64_t k;
+
+  while (1) {
+    u = zipf->h_n + rng_double(rng) * (zipf->h_x1 - zipf->h_n);
+    x = zipf_h_integral_inverse(zipf, u);
+    k = (uint64_t) (x + 0.5);
+    if (k < 1) {
+      k = 1;
+    } else if (k > zipf->n) {
+      k = zipf->n;
+    }
+    if (k - x <= zipf->threshold || u >= zipf_h_integral(zipf, k + 0.5) - zipf_h(zipf, k)) {
+      return k - 1;
+    }
+  }
+}
+
+static int add_segment(struct template *template, enum template_type type, const char *text, size_t length)
+{
+  struct template_segment *segment, *segments;
+
+  if (type == TEMPLATE_LITERAL && !length) {
+    return 0;
+  }
+  /* adjacent literals are merged, which also folds in {{name}} */
+  if (type == TEMPLATE_LITERAL && template->count && template->segments[template->count - 1].type == TEMPLATE_LITERAL) {
+    segment = &template->segments[template->count - 1];
+    segment->text = realloc(segment->text, segment->length + length);
+    if (segment->text == NULL) {
+      return -1;
+    }
+    memcpy(segment->text + segment->length, text, length);
+    segment->length += length;
+    template->max_length += length;
+    return 0;
+  }
+  segments = realloc(template->segments, (template->count + 1) * sizeof(*segments));
+  if (segments == NULL) {
+    return -1;
+  }
+  template->segments = segments;
+  segment = &segments[template->count++];
+  memset(segment, 0, sizeof(*segment));
+  segment->type = type;
+  if (type == TEMPLATE_LITERAL) {
+    segment->text = malloc(length);
+    if (segment->text == NULL) {
+      return -1;
+    }
+    memcpy(segment->text, text, length);
+    segment->length = length;
+    template->max_length += length;
+  } else {
+    template->max_length += NUMBER_LENGTH;
+  }
+  return 0;
+}
+
+/* parses the inside of {{...}} */
+static int add_placeholder(struct template *template, const char *text, size_t length, const char *name)
+{
+  struct template_segment *segment;
+  char spec[128], *kind, *first, *second, *end;
+  double s;
+
+  if (length >= sizeof(spec)) {
+    return -1;
+  }
+  memcpy(spec, text, length);
+  spec[length] = 0;
+
+  if (!strcmp(spec, "seq")) {
+    return add_segment(template, TEMPLATE_SEQ, NULL, 0);
+  }
+  if (!strcmp(spec, "worker")) {
+    return add_segment(template, TEMPLATE_WORKER, NULL, 0);
+  }
+  if (!strcmp(spec, "name")) {
+    return add_segment(template, TEMPLATE_LITERAL, name, strlen(name));
+  }
+  if (strncmp(spec, "key:", 4)) {
+    return -1;
+  }
+  kind = spec + 4;
+  if ((first = strchr(kind, ':')) == NULL || (second = strchr(++first, ':')) == NULL) {
+    return -1;
+  }
+  *(first - 1) = 0;
+  *second++ = 0;
+
+  if (!strcmp(kind, "uniform")) {
+    if (add_segment(template, TEMPLATE_UNIFORM, NULL, 0)) {
+      return -1;
+    }
+    segment = &template->segments[template->count - 1];
+    segment->low = strtoull(first, &end, 10);
+    if (*end) {
+      return -1;
+    }
+    segment->high = strtoull(second, &end, 10);
+    return (*end || segment->high < segment->low) ? -1 : 0;
+  }
+  if (!strcmp(kind, "zipf")) {
+    if (add_segment(template, TEMPLATE_ZIPF, NULL, 0)) {
+      return -1;
+    }
+    segment = &template->segments[template->count - 1];
+    segment->high = strtoull(first, &end, 10);
+    if (*end || !segment->high) {
+      return -1;
+    }
+    s = strtod(second, &end);
+    if (*end || s <= 0) {
+      return -1;
+    }
+    zipf_init(&segment->zipf, segment->high, s);
+    return 0;
+  }
+  return -1;
+}
+
+/* length of a printf integer conversion such as %lu or %zu at text, or 0 */
+static size_t integer_conversion(const char *text, const char *end)
+{
+  const char *p = text + 1;
+
+  while (p < end && (*p == 'l' || *p == 'z')) {
+    ++p;
+  }
+  return (p < end && (*p == 'u' || *p == 'd' || *p == 'i')) ? p + 1 - text : 0;
+}
+
+int template_parse(struct template *template, const char *text, size_t length, const char *name)
+{
+  const char *end = text + length, *literal = text, *p = text, *close;
+  size_t n;
+  int result;
+
+  memset(template, 0, sizeof(*template));
+  template->weight = 1;
+  while (p < end) {
+    if (p + 1 < end && p[0] == '{' && p[1] == '{') {
+      for (close = p + 2; close + 1 < end && !(close[0] == '}' && close[1] == '}'); ++close) ;
+      if (close + 1 >= end
+          || add_segment(template, TEMPLATE_LITERAL, literal, p - literal)
+          || add_placeholder(template, p + 2, close - p - 2, name)) {
+        goto error;
+      }
+      p = literal = close + 2;
+    } else if (p[0] == '%' && p + 1 < end && (p[1] == '%' || p[1] == 's' || integer_conversion(p, end))) {
+      /* request files written for snprintf(format, seq, name) */
+      if (add_segment(template, TEMPLATE_LITERAL, literal, p - literal)) {
+        goto error;
+      }
+      if (p[1] == '%') {
+        result = add_segment(template, TEMPLATE_LITERAL, "%", 1);
+        n = 2;
+      } else if (p[1] == 's') {
+        result = add_segment(template, TEMPLATE_LITERAL, name, strlen(name));
+        n = 2;
+      } else {
+        result = add_segment(template, TEMPLATE_SEQ, NULL, 0);
+        n = integer_conversion(p, end);
+      }
+      if (result) {
+        goto error;
+      }
+      p = literal = p + n;
+    } else {
+      ++p;
+    }
+  }
+  if (add_segment(template, TEMPLATE_LITERAL, literal, p - literal)) {
+    goto error;
+  }
+  return 0;
+
+error:
+  template_free(template);
+  errno = EINVAL;
+  return -1;
+}
+
+int template_load(struct template *template, const char *path, const char *name)
+{
+  struct stat st;
+  char *text;
+  size_t length = 0;
+  ssize_t n;
+  int fd, result;
+
+  if ((fd = open(path, O_RDONLY)) == -1) {
+    return -1;
+  }
+  if (fstat(fd, &st) == -1 || (text = malloc(st.st_size + 1)) == NULL) {
+    close(fd);
+    return -1;
+  }
+  while (length < (size_t) st.st_size && (n = read(fd, text + length, st.st_size - length)) > 0) {
+    length += n;
+  }
+  close(fd);
+  result = template_parse(template, text, length, name);
+  free(text);
+  return result;
+}
+
+void template_free(struct template *template)
+{
+  size_t i;
+
+  for (i = 0; i < template->count; ++i) {
+    free(template->segments[i].text);
+  }
+  free(template->segments);
+  template->segments = NULL;
+  template->count = 0;
+}
+
+/* spec is FILE[:WEIGHT][,FILE[:WEIGHT]...] */
+int template_mix_load(struct template_mix *mix, const char *spec, const char *name)
+{
+  char *copy = strdup(spec), *file, *next, *colon, *end;
+  struct template *templates;
+  uint64_t weight;
+
+  memset(mix, 0, sizeof(*mix));
+  if (copy == NULL) {
+    return -1;
+  }
+  for (file = copy; file; file = next) {
+    if ((next = strchr(file, ',')) != NULL) {
+      *next++ = 0;
+    }
+    weight = 1;
+    if ((colon = strrchr(file, ':')) != NULL) {
+      weight = strtoull(colon + 1, &end, 10);
+      if (*end || colon[1] == 0) {
+        weight = 1;
+      } else {
+        *colon = 0;
+      }
+    }
+    templates = realloc(mix->templates, (mix->count + 1) * sizeof(*templates));
+    if (templates == NULL) {
+      goto error;
+    }
+    mix->templates = templates;
+    if (template_load(&templates[mix->count], file, name)) {
+      goto error;
+    }
+    templates[mix->count].weight = weight;
+    mix->total_weight += weight;
+    if (templates[mix->count].max_length > mix->max_length) {
+      mix->max_length = templates[mix->count].max_length;
+    }
+    ++mix->count;
+  }
+  free(copy);
+  if (!mix->total_weight) {
+    template_mix_free(mix);
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+
+error:
+  free(copy);
+  template_mix_free(mix);
+  return -1;
+}
+
+void template_mix_free(struct template_mix *mix)
+{
+  size_t i;
+
+  for (i = 0; i < mix->count; ++i) {
+    template_free(&mix->templates[i]);
+  }
+  free(mix->templates);
+  memset(mix, 0, sizeof(*mix));
+}
+
+const struct template *template_pick(const struct template_mix *mix, struct rng *rng)
+{
+  uint64_t pick;
+  size_t i;
+
+  if (mix->count == 1) {
+    return mix->templates;
+  }
+  pick = rng_next(rng) % mix->total_weight;
+  for (i = 0; pick >= mix->templates[i].weight; ++i) {
+    pick -= mix->templates[i].weight;
+  }
+  return &mix->templates[i];
+}
+
+static char *format_number(char *p, uint64_t value)
+{
+  char digits[NUMBER_LENGTH], *d = digits + sizeof(digits);
+  size_t n;
+
+  do {
+    *--d = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  n = digits + sizeof(digits) - d;
+  memcpy(p, d, n);
+  return p + n;
+}
+
+/* buf must hold at least template->max_length bytes */
+size_t template_render(const struct template *template, char *buf, uint64_t seq, uint64_t worker, struct rng *rng)
+{
+  const struct template_segment *segment = template->segments, *end = segment + template->count;
+  char *p = buf;
+
+  for (; segment < end; ++segment) {
+    switch (segment->type) {
+    case TEMPLATE_LITERAL:
+      memcpy(p, segment->text, segment->length);
+      p += segment->length;
+      break;
+    case TEMPLATE_SEQ:
+      p = format_number(p, seq);
+      break;
+    case TEMPLATE_WORKER:
+      p = format_number(p, worker);
+      break;
+    case TEMPLATE_UNIFORM:
+      p = format_number(p, segment->high - segment->low == ~(uint64_t) 0 ? rng_next(rng)
+          : segment->low + rng_next(rng) % (segment->high - segment->low + 1));
+      break;
+    case TEMPLATE_ZIPF:
+      p = format_number(p, zipf_next(&segment->zipf, rng));
+      break;
+    }
+  }
+  return p - buf;
+}
@@ -0,0 +1,68 @@
+#ifndef TEMPLATE_H
+#define TEMPLATE_H
+#include <stddef.h>
+#include <stdint.h>
+
+/* request templates are parsed once into literal segments and placeholders
+ *   {{seq}}                 request sequence number
+ *   {{worker}}              worker thread id
+ *   {{name}}                test name, folded into the literals at load time
+ *   {{key:uniform:LOW:HIGH}} uniform random key in [LOW, HIGH]
+ *   {{key:zipf:N:S}}        zipf distributed key in [0, N) with exponent S
+ * printf style %lu and %s from older request files map to seq and name
+ */
+enum template_type {
+  TEMPLATE_LITERAL,
+  TEMPLATE_SEQ,
+  TEMPLATE_WORKER,
+  TEMPLATE_UNIFORM,
+  TEMPLATE_ZIPF
+};
+
+/* xorshift64*, one per worker */
+struct rng {
+  uint64_t state;
+};
+
+/* rejection-inversion sampling, constant time per key for any N */
+struct zipf {
+  uint64_t n;
+  double s, h_x1, h_n, threshold;
+};
+
+struct template_segment {
+  enum template_type type;
+  char *text;
+  size_t length;
+  uint64_t low, high;
+  struct zipf zipf;
+};
+
+struct template {
+  struct template_segment *segments;
+  size_t count;
+  size_t max_length;
+  uint64_t weight;
+};
+
+struct template_mix {
+  struct template *templates;
+  size_t count;
+  uint64_t total_weight;
+  size_t max_length;
+};
+
+void rng_seed(struct rng *rng, uint64_t seed);
+uint64_t rng_next(struct rng *rng);
+double rng_double(struct rng *rng);
+void zipf_init(struct zipf *zipf, uint64_t n, double s);
+uint64_t zipf_next(const struct zipf *zipf, struct rng *rng);
+
+int template_parse(struct template *template, const char *text, size_t length, const char *name);
+int template_load(struct template *template, const char *path, const char *name);
+void template_free(struct template *template);
+int template_mix_load(struct template_mix *mix, const char *spec, const char *name);
+void template_mix_free(struct template_mix *mix);
+const struct template *template_pick(const struct template_mix *mix, struct rng *rng);
+size_t template_render(const struct template *template, char *buf, uint64_t seq, uint64_t worker, struct rng *rng);
+#endif/*TEMPLATE_H*/
@@ -0,0 +1,181 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "trace.h"
+
+int trace_open(struct trace *trace, const char *path)
+{
+  struct trace_cursor cursor;
+  struct trace_record record;
+  struct stat st;
+  void *data;
+  int fd, result;
+
+  memset(trace, 0, sizeof(*trace));
+  if ((fd = open(path, O_RDONLY)) == -1) {
+    return -1;
+  }
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return -1;
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return -1;
+  }
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+  trace->data = data;
+  trace->size = st.st_size;
+  trace->binary = trace->size >= TRACE_MAGIC_LENGTH && !memcmp(data, TRACE_MAGIC, TRACE_MAGIC_LENGTH);
+
+  /* replay is timed relative to the first record */
+  trace_cursor_init(trace, &cursor);
+  result = trace_next(trace, &cursor, &record);
+  trace_cursor_free(&cursor);
+  if (result != 1) {
+    trace_close(trace);
+    errno = EINVAL;
+    return -1;
+  }
+  trace->start = record.timestamp;
+  return 0;
+}
+
+void trace_close(struct trace *trace)
+{
+  if (trace->data) {
+    munmap((void *) trace->data, trace->size);
+  }
+  trace->data = NULL;
+}
+
+void trace_cursor_init(const struct trace *trace, struct trace_cursor *cursor)
+{
+  memset(cursor, 0, sizeof(*cursor));
+  cursor->offset = trace->binary ? TRACE_MAGIC_LENGTH : 0;
+}
+
+void trace_cursor_free(struct trace_cursor *cursor)
+{
+  free(cursor->buffer);
+  cursor->buffer = NULL;
+}
+
+static int next_binary(const struct trace *trace, struct trace_cursor *cursor, struct trace_record *record)
+{
+  uint32_t length;
+  size_t header = 2 * sizeof(uint64_t) + sizeof(uint32_t);
+
+  if (cursor->offset == trace->size) {
+    return 0;
+  }
+  if (trace->size - cursor->offset < header) {
+    return -1;
+  }
+  memcpy(&record->timestamp, trace->data + cursor->offset, sizeof(uint64_t));
+  memcpy(&record->key, trace->data + cursor->offset + sizeof(uint64_t), sizeof(uint64_t));
+  memcpy(&length, trace->data + cursor->offset + 2 * sizeof(uint64_t), sizeof(uint32_t));
+  if (trace->size - cursor->offset - header < length) {
+    return -1;
+  }
+  record->request = trace->data + cursor->offset + header;
+  record->length = length;
+  cursor->offset += header + length;
+  return 1;
+}
+
+/* reads TIMESTAMP, microseconds unless it has a fractional part of seconds */
+static const char *parse_timestamp(const char *p, const char *end, uint64_t *timestamp)
+{
+  uint64_t value = 0, scale = 1000000;
+  const char *start = p;
+
+  while (p < end && *p >= '0' && *p <= '9') {
+    value = value * 10 + (*p++ - '0');
+  }
+  if (p == start) {
+    return NULL;
+  }
+  if (p < end && *p == '.') {
+    value *= 1000000;
+    for (++p; p < end && *p >= '0' && *p <= '9'; ++p) {
+      if (scale /= 10) {
+        value += (*p - '0') * scale;
+      }
+    }
+  }
+  *timestamp = value;
+  return p;
+}
+
+static int next_text(const struct trace *trace, struct trace_cursor *cursor, struct trace_record *record)
+{
+  const char *p, *line, *end, *stop = trace->data + trace->size;
+  char *out;
+
+  while (cursor->offset < trace->size) {
+    line = trace->data + cursor->offset;
+    end = memchr(line, '\n', stop - line);
+    if (end == NULL) {
+      end = stop;
+    }
+    cursor->offset = end - trace->data + (end < stop);
+    if (end > line && end[-1] == '\r') {
+      --end;
+    }
+    if (line == end || *line == '#') {
+      continue;
+    }
+
+    if ((p = parse_timestamp(line, end, &record->timestamp)) == NULL || p == end || *p != ' ') {
+      return -1;
+    }
+    for (record->key = 0, line = ++p; p < end && *p >= '0' && *p <= '9'; ++p) {
+      record->key = record->key * 10 + (*p - '0');
+    }
+    if (p == line || (p < end && *p++ != ' ')) {
+      return -1;
+    }
+
+    if (cursor->capacity < (size_t) (end - p)) {
+      free(cursor->buffer);
+      cursor->capacity = 2 * (end - p);
+      if ((cursor->buffer = malloc(cursor->capacity)) == NULL) {
+        cursor->capacity = 0;
+        return -1;
+      }
+    }
+    for (out = cursor->buffer; p < end; ++p) {
+      if (*p != '\\' || p + 1 == end) {
+        *out++ = *p;
+        continue;
+      }
+      switch (*++p) {
+      case 'r': *out++ = '\r'; break;
+      case 'n': *out++ = '\n'; break;
+      case 't': *out++ = '\t'; break;
+      default: *out++ = *p;
+      }
+    }
+    record->request = cursor->buffer;
+    record->length = out - cursor->buffer;
+    return 1;
+  }
+  return 0;
+}
+
+/* returns 1 with the next record, 0 at the end of the trace and -1 if it is malformed */
+int trace_next(const struct trace *trace, struct trace_cursor *cursor, struct trace_record *record)
+{
+  return trace->binary ? next_binary(trace, cursor, record) : next_text(trace, cursor, record);
+}
@@ -0,0 +1,45 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <stddef.h>
+#include <stdint.h>
+
+/* binary traces start with this magic and hold native endian records of
+ *   uint64_t timestamp in microseconds, uint64_t key, uint32_t length, request bytes
+ * anything else is read as text, one request per line
+ *   TIMESTAMP KEY REQUEST
+ * where TIMESTAMP is microseconds, or seconds if it has a fractional part, and
+ * REQUEST runs to the end of the line with \r, \n, \t and \\ escapes
+ */
+#define TRACE_MAGIC "TGTRACE1"
+#define TRACE_MAGIC_LENGTH 8
+
+/* the file is mapped rather than read, so traces larger than memory stream
+ * through the page cache
+ */
+struct trace {
+  const char *data;
+  size_t size;
+  int binary;
+  uint64_t start;
+};
+
+/* position of one reader, text requests are unescaped into buffer */
+struct trace_cursor {
+  size_t offset;
+  char *buffer;
+  size_t capacity;
+};
+
+struct trace_record {
+  uint64_t timestamp;
+  uint64_t key;
+  const char *request;
+  size_t length;
+};
+
+int trace_open(struct trace *trace, const char *path);
+void trace_close(struct trace *trace);
+void trace_cursor_init(const struct trace *trace, struct trace_cursor *cursor);
+void trace_cursor_free(struct trace_cursor *cursor);
+int trace_next(const struct trace *trace, struct trace_cursor *cursor, struct trace_record *record);
+#endif/*TRACE_H*/
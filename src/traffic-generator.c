@@ -1,46 +1,175 @@
 #define MAIN
 #include <errno.h>
-#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/tcp.h>
-#include <signal.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/mman.h>
 #include <sys/prctl.h>
-#include <sys/select.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
-#include <sys/wait.h>
-#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include "histogram.h"
+#include "http-framer.h"
+#include "template.h"
+#include "trace.h"
 
-#define MAXLINE 2048
+#define MAX_EVENTS 256
+#define READ_SIZE 65536
+/* requests due at once are rendered back to back and written together,
+   up to this many bytes or BATCH_LIMIT requests */
+#define WRITE_SIZE 65536
+#define BATCH_LIMIT 64
+/* epoll data of the worker's timerfd, connections use their index */
+#define TIMER_EVENT UINT32_MAX
+/* longest a worker sleeps in milliseconds before it looks at the stop flag */
+#define POLL_LIMIT 100
+/* the SLO search doubles from the start rate until a step fails, then bisects */
+#define SLO_START_RATE 1000
+#define SLO_MAX_STEPS 32
+#define SLO_PRECISION 0.02
+/* time given to connections to open before a trace starts replaying */
+#define TRACE_LEAD 100000
 static const char USAGE[] =
-  "Usage: %s [-d DELAY] [-n NAME] [-p PRINT_FREQ] [-r NUM_REQUESTS] [-t NUM_THREADS] [-w WAIT_TIME] FILE HOST PORT\n"
+  "Usage: %s [-c NUM_CONNECTIONS] [-C RATE] [-d DELAY] [-H] [-k REQUESTS] [-L PCT:LIMIT] [-O TIMEOUT] [-n NAME] [-f FORMAT] [-p PRINT_FREQ] [-P DEPTH] [-r NUM_REQUESTS] [-S STEP] [-t NUM_THREADS] [-T TRACE] [-w WAIT_TIME] [-x SPEED] FILE HOST PORT\n"
   "Generate traffic based on the contents of FILE to a given HOST:PORT\n"
   "\n"
+  "FILE is a request template, FILE:WEIGHT,FILE:WEIGHT mixes several templates by weight.\n"
+  "Templates may contain {{seq}}, {{worker}}, {{name}}, {{key:uniform:LOW:HIGH}} and {{key:zipf:N:S}},\n"
+  "%%lu and %%s are still read as the sequence number and name.\n"
+  "\n"
+  "  -c     The number of connections, spread over the threads (default: one per thread)\n"
+  "  -C     Churn connections, opening RATE new connections per second with at most -c open at once\n"
   "  -d     The delay in microseconds between requests (default: 0)\n"
+  "  -f     The format of the reports, text, json with one object per line or csv (default: text)\n"
+  "  -H     Frame responses as HTTP/1.1 and count them by status class\n"
+  "  -k     With -C, the number of requests to send on a connection before closing it (default: 1)\n"
+  "  -L     Search for the highest rate whose PCT percentile latency stays within LIMIT microseconds with no errors\n"
   "  -n     A test name to insert into the message to keep track of\n"
   "  -p     The frequence at which to print information (default: never)\n"
+  "  -O     With -C, the time in microseconds a connect may take before it is abandoned (default: 1000000)\n"
+  "  -P     With -H, the number of requests a connection may have awaiting a response (default: 1)\n"
   "  -r     The number of requests to send (default: no limit)\n"
+  "  -S     With -L, the time in microseconds each rate is measured for after a quarter of it to settle (default: 2000000)\n"
   "  -t     The number of threads to use (default: 1)\n"
-  "  -w     The time in microseconds to wait after sending all requests before closing the connection (default: 0)\n";
+  "  -T     Replay the requests in TRACE at their recorded times instead of FILE, which is then omitted\n"
+  "  -w     The time in microseconds to wait after sending all requests before closing the connection (default: 0)\n"
+  "  -x     With -T, the factor to speed up the trace by (default: 1)\n"
+  "\n"
+  "TRACE lines are TIMESTAMP KEY REQUEST, with TIMESTAMP in microseconds or fractional seconds and\n"
+  "\\r, \\n, \\t escapes in REQUEST, or it is a binary trace, see trace.h. Requests with the same KEY\n"
+  "share a connection.\n"
+  "\n"
+  "Latency is measured from the oldest unanswered request on a connection to the first response bytes,\n"
+  "or with -H from the write of each request to the end of its response. With -C, connect latency is\n"
+  "the handshake and first byte latency runs from the start of the connect to the first response bytes\n";
 
 char *host, *port, *name;
-char request_format[MAXLINE];
+struct template_mix mix;
 size_t requests_arg = -1;
 size_t delay_arg = 0;
+/* nanoseconds between requests over all workers, the SLO search steers it */
+uint64_t pace = 0;
+int stop = 0;
 size_t threads = 1;
+size_t connections = 0;
 size_t wait_time = 0;
+int http = 0;
+size_t depth = 1;
+struct trace trace;
+double speed = 1;
+uint64_t replay_start;
+double churn_rate = 0;
+size_t churn_requests = 1;
+size_t connect_timeout = 1000000;
+double slo_percentile = 0;
+size_t slo_limit = 0;
+size_t slo_step = 2000000;
+struct addrinfo *address;
+struct worker *workers;
+/* the reporter thread ticks until report_done is set */
+enum { FORMAT_TEXT, FORMAT_JSON, FORMAT_CSV } format = FORMAT_TEXT;
+size_t print_arg = -1;
+pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t report_cond;
+int report_done = 0;
 
+/* one block per worker, aligned so that workers never write to the same cache line */
 struct stats {
   size_t requests;
   size_t response_bytes;
+  size_t connect_errors;
+  size_t read_errors;
+  size_t write_errors;
+  size_t closed;
+  size_t responses;
+  size_t status[6];
+  size_t parse_errors;
+  size_t dropped;
+  size_t connects;
+  size_t connect_timeouts;
+  size_t churned;
+  size_t syscalls;
+  struct histogram latency;
+  struct histogram drift;
+  struct histogram connect;
+  struct histogram first_byte;
+} __attribute__((aligned(64)));
+struct stats * stats;
+
+/* a non-blocking connection, pending holds the tail of a partial write */
+struct connection {
+  int fd;
+  int connected;
+  int queued;
+  int first_byte;
+  uint64_t connect_start;
+  size_t requests;
+  uint64_t sent_at;
+  char *pending;
+  size_t pending_off;
+  size_t pending_len;
+  /* with -H, send times of the requests awaiting a response */
+  struct http_framer framer;
+  uint64_t *sent;
+  size_t sent_head;
+  size_t outstanding;
+};
+
+/* each worker thread multiplexes its share of the connections through one epoll set,
+   ready is a ring of writable connections that requests are sent on in turn */
+struct worker {
+  size_t id;
+  pthread_t thread;
+  int epollfd;
+  int timerfd;
+  uint64_t armed;
+  size_t count;
+  size_t open;
+  struct connection *conns;
+  uint32_t *ready;
+  size_t ready_head;
+  size_t ready_count;
+  size_t outstanding;
+  /* slots without a connection, churn opens new connections in these */
+  uint32_t *free;
+  size_t free_count;
+};
+
+/* a worker's place in the trace, held is set while a due record waits for its connection */
+struct replay {
+  struct trace_cursor cursor;
+  struct trace_record record;
+  int held;
 };
-volatile struct stats * stats;
 
 uint64_t microseconds(void) {
   struct timeval tv;
@@ -48,139 +177,838 @@ uint64_t microseconds(void) {
   return tv.tv_sec * (uint64_t) 1000000 + tv.tv_usec;
 }
 
-int open_socketfd(char *hostname, char* portnum, int flags, int (*func)(int, const struct sockaddr*, socklen_t)) {
-  int socketfd;
-  struct addrinfo hints, *hostaddresses = NULL;
-  memset(&hints, 0, sizeof(hints));
-  /* ai_flags indicating what type of connection there is
-     flags is expected to be either PASSIVE or V4_MAPPED */
-  hints.ai_flags = AI_ADDRCONFIG | flags;
-  /* indicates an ip4 address */
-  hints.ai_family = AF_INET;
-  /* looking for a stream connection */
-  hints.ai_socktype = SOCK_STREAM;
-  /* asks the DNS server for the address */
-  if(getaddrinfo(hostname, portnum, &hints, &hostaddresses) != 0) {
-    return -3;
-  }
-  /* creates a socket to that address */
-  if((socketfd = socket(hostaddresses->ai_family, hostaddresses->ai_socktype, hostaddresses->ai_protocol)) == -1) {
-    freeaddrinfo(hostaddresses);
-    return -2;
-  }
-  /* either binds or connects to the address */
-  if(connect(socketfd, hostaddresses->ai_addr, hostaddresses->ai_addrlen) == -1) {
-    freeaddrinfo(hostaddresses);
-    close(socketfd);
-    return -1;
+static void ready_push(struct worker *w, uint32_t i) {
+  if (w->conns[i].queued) {
+    return;
+  }
+  w->conns[i].queued = 1;
+  w->ready[(w->ready_head + w->ready_count++) % w->count] = i;
+}
+
+static uint32_t ready_pop(struct worker *w) {
+  uint32_t i = w->ready[w->ready_head];
+  w->ready_head = (w->ready_head + 1) % w->count;
+  --w->ready_count;
+  w->conns[i].queued = 0;
+  return i;
+}
+
+static void connection_close(struct worker *w, struct connection *c) {
+  close(c->fd);
+  ++stats[w->id].syscalls;
+  c->fd = -1;
+  free(c->pending);
+  c->pending = NULL;
+  w->outstanding -= c->outstanding;
+  c->outstanding = 0;
+  --w->open;
+  w->free[w->free_count++] = c - w->conns;
+}
+
+/* a connection takes another request once its last one is written and, with -H,
+   fewer than depth responses are outstanding */
+static int can_send(struct connection *c) {
+  return !c->pending && (!http || c->outstanding < depth) && (!churn_rate || c->requests < churn_requests);
+}
+
+/* with -C, a connection is closed once its requests are sent and answered */
+static int churn_done(struct connection *c) {
+  return churn_rate && c->requests >= churn_requests && (http ? !c->outstanding : !c->sent_at);
+}
+
+static void response_done(struct worker *w, struct connection *c, int status) {
+  struct stats *s = &stats[w->id];
+
+  ++s->responses;
+  ++s->status[status / 100 < 6 ? status / 100 : 0];
+  if (c->outstanding) {
+    histogram_record(&s->latency, microseconds() - c->sent[c->sent_head]);
+    c->sent_head = (c->sent_head + 1) % depth;
+    --c->outstanding;
+    --w->outstanding;
+  }
+  if (can_send(c)) {
+    ready_push(w, c - w->conns);
   }
-  freeaddrinfo(hostaddresses);
-  return socketfd;
 }
 
-void send_requests(int threadid) {
-  size_t last_request, delta;
-  size_t requests = requests_arg / threads + ((requests_arg % threads) > threadid), delay = delay_arg * threads;
-  fd_set rfds, wfds;
-  struct timeval timeout;
-  char buf[MAXLINE];
-  int n, clientfd = -1;
-  char tcp_nodelay = 1;
+/* splits the stream into responses, returns -1 if it is not HTTP */
+static int http_receive(struct worker *w, struct connection *c, const char *data, size_t length) {
+  ssize_t used;
+  int status;
 
-  /* looks up server and connects */
-  if((clientfd = open_socketfd(host, port, AI_V4MAPPED, &connect)) < 0) {
-    /* NOTE: printf/fprintf don't actually work multithreaded, so lines can occaisionally get jumbled */
-    fprintf(stderr, "Error connecting to server %s:%s returned %d\n", host, port, clientfd);
-    return;
+  while (length) {
+    used = http_framer_feed(&c->framer, data, length, &status);
+    if (used < 0) {
+      return -1;
+    }
+    data += used;
+    length -= used;
+    if (status) {
+      response_done(w, c, status);
+    }
+  }
+  return 0;
+}
+
+/* starts a non-blocking connect, completion is signalled by EPOLLOUT */
+static int connection_open(struct worker *w, uint32_t i) {
+  struct connection *c = &w->conns[i];
+  struct epoll_event ev;
+  int tcp_nodelay = 1;
+
+  /* queued is left alone, a stale ready entry is skipped when popped */
+  c->connected = 0;
+  c->first_byte = 0;
+  c->requests = 0;
+  c->sent_at = 0;
+  c->sent_head = 0;
+  c->connect_start = microseconds();
+  c->fd = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK, address->ai_protocol);
+  if (c->fd == -1) {
+    return -1;
   }
-  if(setsockopt(clientfd, IPPROTO_TCP, TCP_NODELAY, (char*)&tcp_nodelay, sizeof(int)) == -1) {
+  if (setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &tcp_nodelay, sizeof(tcp_nodelay)) == -1) {
     fprintf(stderr, "Error setting no delay - continuing\n");
   }
+  if (connect(c->fd, address->ai_addr, address->ai_addrlen) == -1 && errno != EINPROGRESS) {
+    close(c->fd);
+    c->fd = -1;
+    return -1;
+  }
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  ev.data.u32 = i;
+  if (epoll_ctl(w->epollfd, EPOLL_CTL_ADD, c->fd, &ev) == -1) {
+    close(c->fd);
+    c->fd = -1;
+    return -1;
+  }
+  http_framer_init(&c->framer);
+  /* socket, setsockopt, connect and epoll_ctl */
+  stats[w->id].syscalls += 4;
+  ++w->open;
+  return 0;
+}
 
-  last_request = microseconds() + delay_arg * threadid;
-  while (stats[threadid].requests < requests) {
-    FD_ZERO(&rfds);
-    FD_ZERO(&wfds);
-    FD_SET(clientfd, &rfds);
+/* returns 1 once nothing is pending, 0 if the socket is full and -1 on error */
+static int connection_flush(struct worker *w, struct connection *c) {
+  ssize_t n;
 
-    delta = microseconds() - last_request;
-    if (delta > delay) {
-      FD_SET(clientfd, &wfds);
-      timeout.tv_sec = 0;
-      timeout.tv_usec = 0;
-    } else {
-      timeout.tv_sec = (delay - delta) / 1000000L;
-      timeout.tv_usec = (delay - delta) % 1000000L;
+  while (c->pending_off < c->pending_len) {
+    ++stats[w->id].syscalls;
+    n = write(c->fd, c->pending + c->pending_off, c->pending_len - c->pending_off);
+    if (n == -1) {
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    c->pending_off += n;
+  }
+  free(c->pending);
+  c->pending = NULL;
+  return 1;
+}
+
+static int send_request(struct worker *w, struct connection *c, const char *buf, size_t len) {
+  ssize_t n = write(c->fd, buf, len);
+
+  ++stats[w->id].syscalls;
+  if (n == -1) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      return -1;
+    }
+    n = 0;
+  }
+  if ((size_t) n < len) {
+    c->pending_len = len - n;
+    c->pending_off = 0;
+    c->pending = malloc(c->pending_len);
+    if (c->pending == NULL) {
+      return -1;
     }
+    memcpy(c->pending, buf + n, c->pending_len);
+  }
+  return 0;
+}
 
-    select(clientfd+1, &rfds, &wfds, NULL, (delta > delay) ? NULL : &timeout);
+static void handle_event(struct worker *w, struct epoll_event *ev, char *buf) {
+  uint32_t i = ev->data.u32;
+  struct connection *c = &w->conns[i];
+  socklen_t len = sizeof(int);
+  int error = 0;
+  ssize_t n;
 
-    if (FD_ISSET(clientfd, &rfds)) {
-      n = read(clientfd, buf, sizeof(buf));
-      if (n < 0) {
-        fprintf(stderr, "Error reading from socket\n");
+  if (c->fd == -1) {
+    return;
+  }
+  if (!c->connected && (ev->events & (EPOLLOUT | EPOLLERR))) {
+    getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+    ++stats[w->id].syscalls;
+    if (error) {
+      fprintf(stderr, "Error connecting to server %s:%s: %s\n", host, port, strerror(error));
+      ++stats[w->id].connect_errors;
+      connection_close(w, c);
+      return;
+    }
+    c->connected = 1;
+    ++stats[w->id].connects;
+    histogram_record(&stats[w->id].connect, microseconds() - c->connect_start);
+  }
+  if (ev->events & EPOLLIN) {
+    /* edge triggered, so drain everything available. a short read means the socket
+       is empty, so unless the peer has also closed its side no read is spent on EAGAIN */
+    do {
+      ++stats[w->id].syscalls;
+      if ((n = read(c->fd, buf, READ_SIZE)) <= 0) {
         break;
       }
-      if (n == 0) {
-        printf("%lu client: connection closed\n", microseconds());
-        break;
+      if (!c->first_byte) {
+        histogram_record(&stats[w->id].first_byte, microseconds() - c->connect_start);
+        c->first_byte = 1;
       }
-      stats[threadid].response_bytes += n;
-    }
-    if (FD_ISSET(clientfd, &wfds)) {
-      n = snprintf(buf, MAXLINE, request_format, stats[threadid].requests * threads + threadid, name);
-      if (n >= MAXLINE) {
-        fprintf(stderr, "Request larger than max line\n");
+      stats[w->id].response_bytes += n;
+      if (!http) {
+        if (c->sent_at) {
+          histogram_record(&stats[w->id].latency, microseconds() - c->sent_at);
+          c->sent_at = 0;
+        }
+      } else if (http_receive(w, c, buf, n) == -1) {
+        fprintf(stderr, "Error parsing HTTP response\n");
+        ++stats[w->id].parse_errors;
+        connection_close(w, c);
         return;
       }
-      n = write(clientfd, buf, n);
-      ++stats[threadid].requests;
-      if (n == 0) {
+    } while (n == READ_SIZE || (ev->events & EPOLLRDHUP));
+    if (churn_done(c)) {
+      ++stats[w->id].churned;
+      connection_close(w, c);
+      return;
+    }
+    if (n == 0) {
+      if (http && http_framer_closed(&c->framer)) {
+        response_done(w, c, http_framer_closed(&c->framer));
+      }
+      printf("%lu client: connection closed\n", microseconds());
+      ++stats[w->id].closed;
+      connection_close(w, c);
+      return;
+    }
+    if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      fprintf(stderr, "Error reading from socket\n");
+      ++stats[w->id].read_errors;
+      connection_close(w, c);
+      return;
+    }
+  }
+  if (ev->events & EPOLLERR) {
+    getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+    fprintf(stderr, "Error on socket: %s\n", strerror(error));
+    ++stats[w->id].read_errors;
+    connection_close(w, c);
+    return;
+  }
+  if (ev->events & EPOLLOUT) {
+    switch (c->pending ? connection_flush(w, c) : 1) {
+    case -1:
+      fprintf(stderr, "Error writing to socket\n");
+      ++stats[w->id].write_errors;
+      connection_close(w, c);
+      return;
+    case 1:
+      if (can_send(c)) {
+        ready_push(w, i);
+      }
+    }
+  }
+}
+
+/* how many more requests a connection may be given in one write */
+static size_t send_limit(struct connection *c, size_t limit) {
+  if (http && depth - c->outstanding < limit) {
+    limit = depth - c->outstanding;
+  }
+  if (churn_rate && churn_requests - c->requests < limit) {
+    limit = churn_requests - c->requests;
+  }
+  return limit;
+}
+
+static void request_sent(struct worker *w, struct connection *c, uint64_t now) {
+  if (http) {
+    c->sent[(c->sent_head + c->outstanding++) % depth] = now;
+    ++w->outstanding;
+  } else if (!c->sent_at) {
+    c->sent_at = now;
+  }
+  ++c->requests;
+  ++stats[w->id].requests;
+}
+
+/* sends the trace records owned by this worker that are due, returns 0 once the
+   trace is done. *due is when the next record is due, or 0 while it waits on its connection */
+static int replay_due(struct worker *w, struct replay *r, size_t requests, uint64_t *due, uint64_t *last_request) {
+  struct stats *s = &stats[w->id];
+  struct connection *c;
+  uint64_t now;
+  int result;
+
+  while (s->requests < requests) {
+    if (!r->held) {
+      /* every worker streams the whole trace and keeps the keys that map to it */
+      while ((result = trace_next(&trace, &r->cursor, &r->record)) == 1 && r->record.key % threads != w->id) ;
+      if (result == -1) {
+        fprintf(stderr, "Malformed trace record at offset %lu\n", r->cursor.offset);
+      }
+      if (result != 1) {
+        return 0;
+      }
+      r->held = 1;
+    }
+    *due = replay_start;
+    if (r->record.timestamp > trace.start) {
+      *due += (uint64_t) ((r->record.timestamp - trace.start) / speed);
+    }
+    now = microseconds();
+    if (now < *due) {
+      return 1;
+    }
+    c = &w->conns[(r->record.key / threads) % w->count];
+    if (c->fd == -1) {
+      ++s->dropped;
+      r->held = 0;
+      continue;
+    }
+    if (!c->connected || !can_send(c)) {
+      *due = 0;
+      return 1;
+    }
+    r->held = 0;
+    if (send_request(w, c, r->record.request, r->record.length) == -1) {
+      fprintf(stderr, "Error writing to socket\n");
+      ++s->write_errors;
+      connection_close(w, c);
+      continue;
+    }
+    histogram_record(&s->drift, now - *due);
+    request_sent(w, c, now);
+    *last_request = now;
+  }
+  return 0;
+}
+
+/* epoll timeouts are whole milliseconds, so sub-millisecond deadlines go through a timerfd */
+static int timer_open(struct worker *w) {
+  struct epoll_event ev;
+
+  /* the default 50us timer slack would swamp short deadlines */
+  prctl(PR_SET_TIMERSLACK, 1UL);
+  w->timerfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK);
+  if (w->timerfd == -1) {
+    return -1;
+  }
+  ev.events = EPOLLIN;
+  ev.data.u32 = TIMER_EVENT;
+  return epoll_ctl(w->epollfd, EPOLL_CTL_ADD, w->timerfd, &ev);
+}
+
+/* handles the events that arrive before until, or any event at all if until is 0 */
+static void worker_poll(struct worker *w, uint64_t until, char *buf) {
+  struct epoll_event events[MAX_EVENTS];
+  struct itimerspec its;
+  uint64_t expirations;
+  int n, e, timeout = POLL_LIMIT;
+
+  if (until) {
+    if (until <= microseconds()) {
+      timeout = 0;
+    } else if (until != w->armed) {
+      /* the timer is only rearmed when the deadline moves */
+      memset(&its, 0, sizeof(its));
+      its.it_value.tv_sec = until / 1000000;
+      its.it_value.tv_nsec = (until % 1000000) * 1000;
+      timerfd_settime(w->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+      w->armed = until;
+      ++stats[w->id].syscalls;
+    }
+  }
+  n = epoll_wait(w->epollfd, events, MAX_EVENTS, timeout);
+  ++stats[w->id].syscalls;
+  for (e = 0; e < n; ++e) {
+    if (events[e].data.u32 == TIMER_EVENT) {
+      read(w->timerfd, &expirations, sizeof(expirations));
+      w->armed = 0;
+      ++stats[w->id].syscalls;
+      continue;
+    }
+    handle_event(w, &events[e], buf);
+  }
+}
+
+/* opens the connections that are due at the churn rate in free slots */
+static void churn_open(struct worker *w, uint64_t *next_open, uint64_t interval) {
+  uint64_t now = microseconds();
+  uint32_t i;
+
+  while (now >= *next_open && w->free_count) {
+    i = w->free[--w->free_count];
+    if (connection_open(w, i) == -1) {
+      fprintf(stderr, "Error connecting to server %s:%s: %s\n", host, port, strerror(errno));
+      ++stats[w->id].connect_errors;
+      w->free[w->free_count++] = i;
+    }
+    *next_open += interval;
+  }
+  if (!w->free_count && *next_open < now) {
+    /* every slot is busy, don't build up a burst */
+    *next_open = now;
+  }
+}
+
+/* abandons connects that have taken longer than the timeout */
+static void churn_sweep(struct worker *w) {
+  uint64_t now = microseconds();
+  size_t i;
+
+  for (i = 0; i < w->count; ++i) {
+    if (w->conns[i].fd != -1 && !w->conns[i].connected && now - w->conns[i].connect_start >= connect_timeout) {
+      ++stats[w->id].connect_timeouts;
+      connection_close(w, &w->conns[i]);
+    }
+  }
+}
+
+void *send_requests(void *arg) {
+  struct worker *w = arg;
+  size_t threadid = w->id;
+  struct stats *s = &stats[threadid];
+  size_t requests = requests_arg / threads + ((requests_arg % threads) > threadid);
+  uint64_t now, next, last_request, until, next_open, next_sweep;
+  uint64_t seen = __atomic_load_n(&pace, __ATOMIC_RELAXED), delay = seen * threads, next_send;
+  uint64_t open_interval = churn_rate ? (uint64_t) (threads * 1000000.0 / churn_rate) : 0;
+  uint64_t sweep_interval = connect_timeout / 4 > 1000 ? connect_timeout / 4 : 1000;
+  size_t request_size = mix.max_length > WRITE_SIZE ? mix.max_length : WRITE_SIZE;
+  char *buf = malloc(READ_SIZE), *request = trace.data ? NULL : malloc(request_size);
+  struct rng rng;
+  struct replay replay;
+  size_t batch, length, due, count, n;
+  uint32_t i;
+
+  rng_seed(&rng, microseconds() * threads + threadid);
+  trace_cursor_init(&trace, &replay.cursor);
+  replay.held = 0;
+  w->epollfd = epoll_create1(0);
+  if (buf == NULL || (request == NULL && !trace.data) || w->epollfd == -1 || timer_open(w) == -1) {
+    fprintf(stderr, "Error creating epoll set for thread %lu\n", threadid);
+    goto done;
+  }
+  for (i = 0; i < w->count && churn_rate; ++i) {
+    w->free[w->free_count++] = w->count - 1 - i;
+  }
+  for (i = 0; i < w->count && !churn_rate; ++i) {
+    if (connection_open(w, i) == -1) {
+      /* NOTE: printf/fprintf don't actually work multithreaded, so lines can occaisionally get jumbled */
+      fprintf(stderr, "Error connecting to server %s:%s: %s\n", host, port, strerror(errno));
+      ++s->connect_errors;
+    }
+  }
+
+  last_request = next = microseconds() + delay_arg * threadid;
+  next_send = next * 1000;
+  next_open = microseconds() + open_interval * threadid / threads;
+  next_sweep = microseconds() + sweep_interval;
+  while ((w->open || churn_rate) && s->requests < requests && !__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+    if (trace.data) {
+      if (!replay_due(w, &replay, requests, &next, &last_request)) {
         break;
       }
-      last_request = microseconds();
+      worker_poll(w, next, buf);
+      continue;
+    }
+
+    if (churn_rate) {
+      churn_open(w, &next_open, open_interval);
+      if (microseconds() >= next_sweep) {
+        churn_sweep(w);
+        next_sweep += sweep_interval;
+      }
+    }
+
+    now = microseconds();
+    if (__atomic_load_n(&pace, __ATOMIC_RELAXED) != seen) {
+      /* the rate was changed, start the new one from now */
+      seen = __atomic_load_n(&pace, __ATOMIC_RELAXED);
+      delay = seen * threads;
+      next_send = now * 1000;
+    }
+    if (!w->ready_count && next_send < now * 1000) {
+      /* don't build up a burst while every connection is blocked */
+      next_send = now * 1000;
     }
+    /* one pass over the ready ring, so reads are not starved */
+    for (batch = w->ready_count; batch && now * 1000 >= next_send && s->requests < requests; --batch) {
+      struct connection *c = &w->conns[i = ready_pop(w)];
+      if (c->fd == -1 || !c->connected || !can_send(c)) {
+        continue;
+      }
+      /* the requests that are due are shared over the ready connections, each
+         connection's share is rendered into one buffer and sent with one write */
+      due = delay ? (now * 1000 - next_send) / delay + 1 : BATCH_LIMIT;
+      count = send_limit(c, (due + batch - 1) / batch);
+      if (count > requests - s->requests) {
+        count = requests - s->requests;
+      }
+      if (count > BATCH_LIMIT) {
+        count = BATCH_LIMIT;
+      }
+      for (n = 0, length = 0; n < count && length + mix.max_length <= request_size; ++n) {
+        length += template_render(template_pick(&mix, &rng), request + length,
+            (s->requests + n) * threads + threadid, threadid, &rng);
+      }
+      if (send_request(w, c, request, length) == -1) {
+        fprintf(stderr, "Error writing to socket\n");
+        ++s->write_errors;
+        connection_close(w, c);
+        continue;
+      }
+      while (n--) {
+        request_sent(w, c, now);
+        next_send += delay;
+      }
+      if (can_send(c)) {
+        ready_push(w, i);
+      }
+      last_request = now;
+    }
+
+    until = w->ready_count ? (next_send + 999) / 1000 : 0;
+    if (churn_rate) {
+      if (w->free_count && (!until || next_open < until)) {
+        until = next_open;
+      }
+      if (!until || next_sweep < until) {
+        until = next_sweep;
+      }
+    }
+    worker_poll(w, until, buf);
   }
 
   /* wait for any stragglers to trickle in */
-  while (1) {
-    FD_ZERO(&rfds);
-    FD_SET(clientfd, &rfds);
-    delta = microseconds() - last_request;
-    if (delta > wait_time) {
+  while (w->open && (!http || w->outstanding)) {
+    now = microseconds();
+    if (now - last_request >= wait_time) {
       break;
     }
-    timeout.tv_sec = (delay - delta) / 1000000L;
-    timeout.tv_usec = (delay - delta) % 1000000L;
+    worker_poll(w, last_request + wait_time, buf);
+  }
 
-    select(clientfd+1, &rfds, NULL, NULL, &timeout);
-    n = read(clientfd, buf, sizeof(buf));
-    if (n < 0) {
-      fprintf(stderr, "Error reading from socket\n");
-      break;
+done:
+  for (i = 0; i < w->count; ++i) {
+    if (w->conns[i].fd != -1) {
+      connection_close(w, &w->conns[i]);
     }
-    if (n == 0) {
-      printf("%lu client: connection closed\n", microseconds());
+  }
+  if (w->epollfd != -1) {
+    close(w->epollfd);
+  }
+  if (w->timerfd != -1) {
+    close(w->timerfd);
+  }
+  free(buf);
+  free(request);
+  trace_cursor_free(&replay.cursor);
+  return NULL;
+}
+
+/* every connection needs a descriptor, so lift the soft limit as far as allowed */
+static void raise_fd_limit(size_t needed) {
+  struct rlimit limit;
+
+  if (getrlimit(RLIMIT_NOFILE, &limit) == -1 || limit.rlim_cur >= needed) {
+    return;
+  }
+  limit.rlim_cur = (limit.rlim_max == RLIM_INFINITY || limit.rlim_max >= needed) ? needed : limit.rlim_max;
+  if (setrlimit(RLIMIT_NOFILE, &limit) == -1 || limit.rlim_cur < needed) {
+    fprintf(stderr, "Warning: open file limit %lu is below the %lu needed\n", (size_t) limit.rlim_cur, needed);
+  }
+}
+
+/* sums the worker blocks, reads race with the workers but every field only grows */
+static void merge_stats(struct stats *total) {
+  size_t i, j;
+
+  memset(total, 0, sizeof(*total));
+  histogram_init(&total->latency);
+  histogram_init(&total->drift);
+  histogram_init(&total->connect);
+  histogram_init(&total->first_byte);
+  for (i = 0; i < threads; ++i) {
+    total->requests += stats[i].requests;
+    total->response_bytes += stats[i].response_bytes;
+    total->connect_errors += stats[i].connect_errors;
+    total->read_errors += stats[i].read_errors;
+    total->write_errors += stats[i].write_errors;
+    total->closed += stats[i].closed;
+    total->responses += stats[i].responses;
+    for (j = 0; j < 6; ++j) {
+      total->status[j] += stats[i].status[j];
+    }
+    total->parse_errors += stats[i].parse_errors;
+    total->dropped += stats[i].dropped;
+    total->connects += stats[i].connects;
+    total->connect_timeouts += stats[i].connect_timeouts;
+    total->churned += stats[i].churned;
+    total->syscalls += stats[i].syscalls;
+    histogram_merge(&total->latency, &stats[i].latency);
+    histogram_merge(&total->drift, &stats[i].drift);
+    histogram_merge(&total->connect, &stats[i].connect);
+    histogram_merge(&total->first_byte, &stats[i].first_byte);
+  }
+}
+
+static size_t stats_errors(const struct stats *s) {
+  return s->connect_errors + s->connect_timeouts + s->read_errors + s->write_errors + s->parse_errors;
+}
+
+static void sleep_us(uint64_t us) {
+  struct timespec ts;
+
+  ts.tv_sec = us / 1000000;
+  ts.tv_nsec = (us % 1000000) * 1000;
+  while (nanosleep(&ts, &ts) == -1 && errno == EINTR) ;
+}
+
+/* runs the workers at rate for one step and returns whether it met the SLO,
+   a step the generator or server could not keep up with fails too */
+static int slo_run(double rate) {
+  static struct stats before, after;
+  uint64_t start, elapsed, latency;
+  double achieved;
+  size_t errors;
+  int pass;
+
+  __atomic_store_n(&pace, (uint64_t) (1000000000.0 / rate), __ATOMIC_RELAXED);
+  sleep_us(slo_step / 4);
+  merge_stats(&before);
+  start = microseconds();
+  sleep_us(slo_step);
+  merge_stats(&after);
+  elapsed = microseconds() - start;
+
+  histogram_delta(&after.latency, &before.latency);
+  achieved = (after.requests - before.requests) * 1000000.0 / elapsed;
+  errors = stats_errors(&after) - stats_errors(&before);
+  latency = histogram_percentile(&after.latency, slo_percentile);
+  pass = after.latency.count && latency <= slo_limit && !errors && achieved >= rate * 0.95;
+  printf("SLO step offered %.0f req/s: achieved %.2f req/s, latency us p50 %lu p90 %lu p99 %lu p99.9 %lu max %lu, errors %lu, %s\n",
+      rate, achieved, histogram_percentile(&after.latency, 50), histogram_percentile(&after.latency, 90),
+      histogram_percentile(&after.latency, 99), histogram_percentile(&after.latency, 99.9), after.latency.max,
+      errors, pass ? "pass" : "fail");
+  fflush(stdout);
+  return pass;
+}
+
+static void slo_search(void) {
+  double rate = SLO_START_RATE, low = 0, high = 0;
+  int step;
+
+  for (step = 0; step < SLO_MAX_STEPS; ++step) {
+    if (slo_run(rate)) {
+      low = rate;
+    } else {
+      high = rate;
+    }
+    if (!high) {
+      rate *= 2;
+      continue;
+    }
+    if (high - low <= high * SLO_PRECISION) {
       break;
     }
+    rate = (low + high) / 2;
+  }
+  if (low) {
+    printf("Max sustainable rate %.0f req/s with p%g latency within %lu us\n", low, slo_percentile, slo_limit);
+  } else {
+    printf("No rate met p%g latency within %lu us\n", slo_percentile, slo_limit);
+  }
+}
+
+static size_t active_connections(void) {
+  size_t i, open = 0;
+
+  for (i = 0; i < threads; ++i) {
+    open += __atomic_load_n(&workers[i].open, __ATOMIC_RELAXED);
+  }
+  return open;
+}
+
+static double syscalls_per_request(const struct stats *current, const struct stats *last) {
+  size_t requests = current->requests - last->requests;
+
+  return requests ? (double) (current->syscalls - last->syscalls) / requests : 0.0;
+}
+
+static void report_text(const struct stats *current, const struct stats *last, const struct stats *interval,
+    uint64_t elapsed) {
+  printf("Average requests per second: %.2f, response MB/S %.2f, latency us p50 %lu p90 %lu p99 %lu p99.9 %lu max %lu, "
+      "errors %lu, syscalls per request %.2f\n",
+      (current->requests - last->requests) * 1000000.0 / elapsed,
+      (current->response_bytes - last->response_bytes) * 0.9536743164 / elapsed,
+      histogram_percentile(&interval->latency, 50), histogram_percentile(&interval->latency, 90),
+      histogram_percentile(&interval->latency, 99), histogram_percentile(&interval->latency, 99.9),
+      interval->latency.max, stats_errors(current) - stats_errors(last), syscalls_per_request(current, last));
+  if (http) {
+    printf("Responses per second: %.2f, 1xx %lu 2xx %lu 3xx %lu 4xx %lu 5xx %lu\n",
+        (current->responses - last->responses) * 1000000.0 / elapsed,
+        current->status[1] - last->status[1], current->status[2] - last->status[2],
+        current->status[3] - last->status[3], current->status[4] - last->status[4],
+        current->status[5] - last->status[5]);
+  }
+  if (trace.data) {
+    printf("Send drift us p50 %lu p90 %lu p99 %lu max %lu, dropped %lu\n",
+        histogram_percentile(&interval->drift, 50), histogram_percentile(&interval->drift, 90),
+        histogram_percentile(&interval->drift, 99), interval->drift.max, current->dropped - last->dropped);
+  }
+  if (churn_rate) {
+    printf("Connections per second: %.2f, connect us p50 %lu p99 %lu max %lu, first byte us p50 %lu p99 %lu max %lu, "
+        "connect errors %lu, timeouts %lu\n",
+        (current->connects - last->connects) * 1000000.0 / elapsed,
+        histogram_percentile(&interval->connect, 50), histogram_percentile(&interval->connect, 99), interval->connect.max,
+        histogram_percentile(&interval->first_byte, 50), histogram_percentile(&interval->first_byte, 99),
+        interval->first_byte.max, current->connect_errors - last->connect_errors,
+        current->connect_timeouts - last->connect_timeouts);
+  }
+}
+
+static void report_total(const struct stats *total) {
+  printf("Total requests %lu, response bytes %lu, latency us p50 %lu p90 %lu p99 %lu p99.9 %lu max %lu, "
+      "connect errors %lu, read errors %lu, write errors %lu, closed %lu, syscalls %lu\n",
+      total->requests, total->response_bytes,
+      histogram_percentile(&total->latency, 50), histogram_percentile(&total->latency, 90),
+      histogram_percentile(&total->latency, 99), histogram_percentile(&total->latency, 99.9),
+      total->latency.count ? total->latency.max : 0,
+      total->connect_errors, total->read_errors, total->write_errors, total->closed, total->syscalls);
+  if (http) {
+    printf("Total responses %lu, 1xx %lu 2xx %lu 3xx %lu 4xx %lu 5xx %lu, parse errors %lu\n",
+        total->responses, total->status[1], total->status[2], total->status[3],
+        total->status[4], total->status[5], total->parse_errors);
+  }
+  if (trace.data) {
+    printf("Total send drift us p50 %lu p90 %lu p99 %lu p99.9 %lu max %lu, dropped %lu\n",
+        histogram_percentile(&total->drift, 50), histogram_percentile(&total->drift, 90),
+        histogram_percentile(&total->drift, 99), histogram_percentile(&total->drift, 99.9),
+        total->drift.count ? total->drift.max : 0, total->dropped);
+  }
+  if (churn_rate) {
+    printf("Total connections %lu, closed after use %lu, connect us p50 %lu p90 %lu p99 %lu p99.9 %lu max %lu, "
+        "first byte us p50 %lu p90 %lu p99 %lu p99.9 %lu max %lu, connect timeouts %lu\n",
+        total->connects, total->churned,
+        histogram_percentile(&total->connect, 50), histogram_percentile(&total->connect, 90),
+        histogram_percentile(&total->connect, 99), histogram_percentile(&total->connect, 99.9),
+        total->connect.count ? total->connect.max : 0,
+        histogram_percentile(&total->first_byte, 50), histogram_percentile(&total->first_byte, 90),
+        histogram_percentile(&total->first_byte, 99), histogram_percentile(&total->first_byte, 99.9),
+        total->first_byte.count ? total->first_byte.max : 0, total->connect_timeouts);
+  }
+}
+
+/* one JSON object per line or one CSV row, interval rows hold the
+   difference from last and the total row the whole run */
+static void report_row(const char *type, const struct stats *current, const struct stats *last, uint64_t elapsed) {
+  static const char *fields[] = {
+    "type", "time_us", "elapsed_us", "offered_rps", "achieved_rps", "response_bytes", "response_mbps",
+    "responses", "errors", "connections", "connects", "p50_us", "p90_us", "p99_us", "p999_us", "max_us", "syscalls_per_request"
+  };
+  static int header = 0;
+  struct stats *delta = malloc(sizeof(*delta));
+  uint64_t current_pace = __atomic_load_n(&pace, __ATOMIC_RELAXED);
+  size_t i, bytes = current->response_bytes - last->response_bytes;
+
+  if (delta == NULL) {
+    return;
+  }
+  *delta = *current;
+  histogram_delta(&delta->latency, &last->latency);
+  if (format == FORMAT_CSV && !header) {
+    for (i = 0; i < sizeof(fields) / sizeof(*fields); ++i) {
+      printf("%s%s", i ? "," : "", fields[i]);
+    }
+    printf("\n");
+    header = 1;
+  }
+  printf(format == FORMAT_JSON ?
+      "{\"type\":\"%s\",\"time_us\":%lu,\"elapsed_us\":%lu,\"offered_rps\":%.2f,\"achieved_rps\":%.2f,"
+      "\"response_bytes\":%lu,\"response_mbps\":%.2f,\"responses\":%lu,\"errors\":%lu,\"connections\":%lu,"
+      "\"connects\":%lu,\"p50_us\":%lu,\"p90_us\":%lu,\"p99_us\":%lu,\"p999_us\":%lu,\"max_us\":%lu,\"syscalls_per_request\":%.2f}\n" :
+      "%s,%lu,%lu,%.2f,%.2f,%lu,%.2f,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%.2f\n",
+      type, microseconds(), elapsed, current_pace ? 1000000000.0 / current_pace : 0.0,
+      (current->requests - last->requests) * 1000000.0 / elapsed, bytes, bytes * 0.9536743164 / elapsed,
+      current->responses - last->responses, stats_errors(current) - stats_errors(last),
+      active_connections(), current->connects - last->connects,
+      histogram_percentile(&delta->latency, 50), histogram_percentile(&delta->latency, 90),
+      histogram_percentile(&delta->latency, 99), histogram_percentile(&delta->latency, 99.9),
+      delta->latency.count ? delta->latency.max : 0, syscalls_per_request(current, last));
+  free(delta);
+}
+
+/* reports every print_arg microseconds on absolute monotonic deadlines, so
+   intervals do not stretch by the time spent reporting, ticks missed while
+   descheduled are skipped rather than reported back to back */
+static void *report(void *arg) {
+  static struct stats current, last, interval;
+  struct timespec deadline, now;
+  /* -p 0 reports as often as it can, a tick of 1 microsecond */
+  uint64_t tick = (print_arg ? print_arg : 1) * 1000, late, elapsed, last_time;
+  int done;
+
+  merge_stats(&last);
+  last_time = microseconds();
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  pthread_mutex_lock(&report_lock);
+  for (;;) {
+    deadline.tv_sec += (deadline.tv_nsec + tick) / 1000000000;
+    deadline.tv_nsec = (deadline.tv_nsec + tick) % 1000000000;
+    while (!report_done && pthread_cond_timedwait(&report_cond, &report_lock, &deadline) != ETIMEDOUT) ;
+    done = report_done;
+    pthread_mutex_unlock(&report_lock);
+    if (done) {
+      return NULL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    late = (now.tv_sec - deadline.tv_sec) * 1000000000 + now.tv_nsec - deadline.tv_nsec;
+    late -= late % tick;
+    deadline.tv_sec += (deadline.tv_nsec + late) / 1000000000;
+    deadline.tv_nsec = (deadline.tv_nsec + late) % 1000000000;
+
+    merge_stats(&current);
+    elapsed = microseconds() - last_time;
+    last_time += elapsed;
+    if (format == FORMAT_TEXT) {
+      interval = current;
+      histogram_delta(&interval.latency, &last.latency);
+      histogram_delta(&interval.drift, &last.drift);
+      histogram_delta(&interval.connect, &last.connect);
+      histogram_delta(&interval.first_byte, &last.first_byte);
+      report_text(&current, &last, &interval, elapsed);
+    } else {
+      report_row("interval", &current, &last, elapsed);
+    }
+    fflush(stdout);
+    last = current;
+    pthread_mutex_lock(&report_lock);
   }
-  close(clientfd);
 }
 
 /* main driver function */
 int main(int argc, char **argv)
 {
-  char * file;
+  char * file = NULL, * trace_path = NULL;
   char * argv0 = argv[0];
-  size_t n, i = 0, j = 1;
-  int fd;
-  size_t print_arg = -1;
-  sigset_t sigchldset;
-  size_t last_print;
-  struct stats current_stats;
-  struct stats last_stats = { 0, 0 };
-  size_t now;
-  struct timespec timeout;
+  size_t i = 0, j = 1;
+  static struct stats current_stats, start_stats;
+  uint64_t start_time;
+  struct addrinfo hints;
+  pthread_condattr_t condattr;
+  pthread_t reporter;
+  int error;
 
   name = argv[0];
 
@@ -192,95 +1020,212 @@ int main(int argc, char **argv)
       i = 0;
       j = 1;
       break;
+    case 'c':
+      connections = atol(argv[++j]);
+      break;
+    case 'C':
+      churn_rate = atof(argv[++j]);
+      break;
     case 'd':
       delay_arg = atol(argv[++j]);
       break;
+    case 'H':
+      http = 1;
+      break;
+    case 'k':
+      churn_requests = atol(argv[++j]);
+      break;
+    case 'L':
+      if (sscanf(argv[++j], "%lf:%lu", &slo_percentile, &slo_limit) != 2 || slo_percentile <= 0 || slo_percentile > 100) {
+        fprintf(stderr, "Expected -L PCT:LIMIT, for example 99:2000\n");
+        return 1;
+      }
+      break;
     case 'n':
       name = argv[++j];
       break;
+    case 'O':
+      connect_timeout = atol(argv[++j]);
+      break;
+    case 'f':
+      ++j;
+      if (!strcmp(argv[j], "text")) {
+        format = FORMAT_TEXT;
+      } else if (!strcmp(argv[j], "json")) {
+        format = FORMAT_JSON;
+      } else if (!strcmp(argv[j], "csv")) {
+        format = FORMAT_CSV;
+      } else {
+        fprintf(stderr, "Unknown report format %s\n", argv[j]);
+        return 1;
+      }
+      break;
     case 'p':
       print_arg = atol(argv[++j]);
       break;
+    case 'P':
+      depth = atol(argv[++j]);
+      break;
     case 'r':
       requests_arg = atol(argv[++j]);
       break;
+    case 'S':
+      slo_step = atol(argv[++j]);
+      break;
     case 't':
       threads = atol(argv[++j]);
       break;
+    case 'T':
+      trace_path = argv[++j];
+      break;
     case 'w':
       wait_time = atol(argv[++j]);
       break;
+    case 'x':
+      speed = atof(argv[++j]);
+      break;
     default:
       fprintf(stderr, "Unrecognized option '%c'\n", argv[1][1]);
       return 1;
     }
   }
 
-  if (argc < 4) {
+  if (argc < (trace_path ? 3 : 4)) {
     fprintf(stderr, USAGE, argv0);
     return 1;
   }
 
-  file = argv[1];
-  host = argv[2];
-  port = argv[3];
+  if (!trace_path) {
+    file = *++argv;
+  }
+  host = argv[1];
+  port = argv[2];
 
-  fd = open(file, O_RDONLY);
-  if (fd == -1) {
-    fprintf(stderr, "Unable to read '%s'\n", file);
+  if (threads == 0) {
+    threads = 1;
+  }
+  if (connections == 0) {
+    connections = threads;
+  }
+  if (threads > connections) {
+    threads = connections;
+  }
+  if (depth == 0) {
+    depth = 1;
+  }
+  if (speed <= 0) {
+    speed = 1;
+  }
+  if (churn_requests == 0) {
+    churn_requests = 1;
+  }
+  if (churn_rate < 0 || (churn_rate && trace_path)) {
+    fprintf(stderr, "Churn needs a positive rate and does not combine with trace replay\n");
     return 1;
   }
-  n = read(fd, request_format, MAXLINE);
-  if (n == MAXLINE) {
-    fprintf(stderr, "Warning: file exceeds max request length of 2048, truncating\n");
+  if (slo_percentile && trace_path) {
+    fprintf(stderr, "The SLO search steers the request rate, so it does not combine with trace replay\n");
+    return 1;
   }
-  close(fd);
+  pace = delay_arg * 1000;
 
-  /* should probably test for failure conditions */
-  stats = mmap(NULL, sizeof(size_t) * threads, PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED, -1, 0);
+  if (trace_path && trace_open(&trace, trace_path) == -1) {
+    fprintf(stderr, "Unable to read trace '%s': %s\n", trace_path, strerror(errno));
+    return 1;
+  }
+  if (file && template_mix_load(&mix, file, name) == -1) {
+    fprintf(stderr, "Unable to load request templates '%s': %s\n", file, strerror(errno));
+    return 1;
+  }
+
+  /* looks up the server once, every connection reuses the address */
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_flags = AI_ADDRCONFIG | AI_V4MAPPED;
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if ((error = getaddrinfo(host, port, &hints, &address)) != 0) {
+    fprintf(stderr, "Error looking up server %s:%s: %s\n", host, port, gai_strerror(error));
+    return 1;
+  }
+  raise_fd_limit(connections + 64);
+
+  stats = mmap(NULL, sizeof(*stats) * threads, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
   if (stats  == MAP_FAILED) {
-    fprintf(stderr, "Failed to map shared memory\n");
+    fprintf(stderr, "Failed to map worker stats\n");
     return 1;
   }
+  for (i = 0; i < threads; ++i) {
+    histogram_init(&stats[i].latency);
+    histogram_init(&stats[i].drift);
+    histogram_init(&stats[i].connect);
+    histogram_init(&stats[i].first_byte);
+  }
+  merge_stats(&start_stats);
 
-  sigemptyset(&sigchldset);
-  sigaddset(&sigchldset, SIGCHLD);
-  sigprocmask(SIG_BLOCK, &sigchldset, NULL);
+  replay_start = microseconds() + TRACE_LEAD;
+  pthread_condattr_init(&condattr);
+  pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+  pthread_cond_init(&report_cond, &condattr);
+  pthread_condattr_destroy(&condattr);
 
+  start_time = microseconds();
+  workers = calloc(threads, sizeof(*workers));
+  if (workers == NULL) {
+    fprintf(stderr, "Failed to allocate workers\n");
+    return 1;
+  }
   for (i = 0; i < threads; ++i) {
-    switch (fork()) {
-    case -1:
-      fprintf(stderr, "Fork failed\n");
+    workers[i].id = i;
+    workers[i].epollfd = -1;
+    workers[i].timerfd = -1;
+    workers[i].count = connections / threads + ((connections % threads) > i);
+    workers[i].conns = calloc(workers[i].count, sizeof(*workers[i].conns));
+    workers[i].ready = calloc(workers[i].count, sizeof(*workers[i].ready));
+    workers[i].free = calloc(workers[i].count, sizeof(*workers[i].free));
+    if (workers[i].conns == NULL || workers[i].ready == NULL || workers[i].free == NULL) {
+      fprintf(stderr, "Failed to allocate connections\n");
       return 1;
-    case 0:
-      prctl(PR_SET_PDEATHSIG, SIGHUP);
-      send_requests(i);
-      return 0;
-    default:
-      ;
     }
-  }
-
-  last_print = microseconds();
-  for (i = 0; i < threads; ) {
-    now = microseconds();
-    if ((now - last_print) >= print_arg) {
-      memset(&current_stats, 0, sizeof(current_stats));
-      for (j = 0; j < threads; ++j) {
-        current_stats.requests += stats[j].requests;
-        current_stats.response_bytes += stats[j].response_bytes;
+    for (j = 0; j < workers[i].count; ++j) {
+      workers[i].conns[j].fd = -1;
+      if (http && (workers[i].conns[j].sent = calloc(depth, sizeof(uint64_t))) == NULL) {
+        fprintf(stderr, "Failed to allocate connections\n");
+        return 1;
       }
-      printf("Average requests per second: %.2f, response MB/S %.2f\n",
-          (current_stats.requests - last_stats.requests) * 1000000.0 / (now - last_print),
-          (current_stats.response_bytes - last_stats.response_bytes) * 0.9536743164 / (now - last_print));
-      last_stats = current_stats;
-      last_print = now;
     }
-    timeout.tv_sec = (print_arg + last_print - now)  / 1000000000UL;
-    timeout.tv_nsec = ((print_arg + last_print - now) % 1000000UL) * 1000;
+    if (pthread_create(&workers[i].thread, NULL, send_requests, &workers[i]) != 0) {
+      fprintf(stderr, "Thread creation failed\n");
+      return 1;
+    }
+  }
+
+  if (print_arg != (size_t) -1 && pthread_create(&reporter, NULL, report, NULL) != 0) {
+    fprintf(stderr, "Thread creation failed\n");
+    return 1;
+  }
+  if (slo_percentile) {
+    slo_search();
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+  }
+  for (i = 0; i < threads; ++i) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  if (print_arg != (size_t) -1) {
+    pthread_mutex_lock(&report_lock);
+    report_done = 1;
+    pthread_cond_signal(&report_cond);
+    pthread_mutex_unlock(&report_lock);
+    pthread_join(reporter, NULL);
+  }
 
-    n = sigtimedwait(&sigchldset, NULL, &timeout);
-    for (; 0 < waitpid(-1, NULL, WNOHANG); ++i) ;
+  merge_stats(&current_stats);
+  if (format == FORMAT_TEXT) {
+    report_total(&current_stats);
+  } else {
+    report_row("total", &current_stats, &start_stats, microseconds() - start_time);
   }
+  freeaddrinfo(address);
+  template_mix_free(&mix);
+  trace_close(&trace);
   return 0;
 }
@@ -1,8 +1,13 @@
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/time.h>
 #include <netdb.h>
+#include <time.h>
 #include "traffic-shared.h"
 
 char log_level = LOG_LEVEL_L;
@@ -14,6 +19,14 @@ uint64_t microseconds(void)
   return tv.tv_sec * (uint64_t) 1000000 + tv.tv_usec;
 }
 
+/* monotonic clock for scheduling, not comparable with microseconds() */
+uint64_t nanoseconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * (uint64_t) 1000000000 + ts.tv_nsec;
+}
+
 int open_socketfd(char *hostname, char* port, int flags, int type, int (*func)(int, const struct sockaddr*, socklen_t))
 {
   int socketfd;
@@ -101,6 +114,10 @@ void logintsockopt(FILE *logfile, int loglevel, int fd, int level, int optname,
   socklen_t len = sizeof(int);
   int optval, error;
 
+  if (loglevel < log_level) {
+    return;
+  }
+
   error = getsockopt(fd, level, optname, &optval, &len);
   if (error == -1) {
     fprintf(stderr, "Error getting socket option %s on %d - continuing\n", optstring, fd);
@@ -109,3 +126,130 @@ void logintsockopt(FILE *logfile, int loglevel, int fd, int level, int optname,
   }
 }
 
+/* puts the socket into non-blocking mode and asks the kernel to busy poll
+ * the device queue for up to budget microseconds on receive
+ */
+void busy_poll_setup(FILE *logfile, int loglevel, int fd, size_t budget)
+{
+  int flags, options[2] = { budget, 1 };
+
+  if (!budget) {
+    return;
+  }
+
+  flags = fcntl(fd, F_GETFL);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    fprintf(stderr, "Error setting O_NONBLOCK on %d - continuing\n", fd);
+  }
+
+#ifdef SO_BUSY_POLL
+  SETSOCKOPT(logfile, loglevel, fd, SOL_SOCKET, SO_BUSY_POLL, &options[0]);
+#endif
+#ifdef SO_PREFER_BUSY_POLL
+  SETSOCKOPT(logfile, loglevel, fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &options[1]);
+#endif
+}
+
+/* select that polls with a zero timeout for up to budget microseconds
+ * before falling back to a blocking select for the rest of the timeout
+ */
+int spin_select(int nfds, fd_set *rfds, fd_set *wfds, struct timeval *timeout, size_t budget)
+{
+  fd_set r, w;
+  struct timeval zero;
+  uint64_t start, elapsed, limit = budget;
+  int n;
+
+  if (!budget) {
+    return select(nfds, rfds, wfds, NULL, timeout);
+  }
+
+  if (timeout && timeout->tv_sec * (uint64_t) 1000000 + timeout->tv_usec < limit) {
+    limit = timeout->tv_sec * (uint64_t) 1000000 + timeout->tv_usec;
+  }
+
+  start = microseconds();
+  do {
+    if (rfds) {
+      r = *rfds;
+    }
+    if (wfds) {
+      w = *wfds;
+    }
+    zero.tv_sec = 0;
+    zero.tv_usec = 0;
+    n = select(nfds, rfds ? &r : NULL, wfds ? &w : NULL, NULL, &zero);
+    if (n != 0) {
+      if (n > 0 && rfds) {
+        *rfds = r;
+      }
+      if (n > 0 && wfds) {
+        *wfds = w;
+      }
+      return n;
+    }
+    elapsed = microseconds() - start;
+  } while (elapsed < limit);
+
+  if (timeout) {
+    limit = timeout->tv_sec * (uint64_t) 1000000 + timeout->tv_usec;
+    limit = limit > elapsed ? limit - elapsed : 0;
+    timeout->tv_sec = limit / 1000000L;
+    timeout->tv_usec = limit % 1000000L;
+  }
+  return select(nfds, rfds, wfds, NULL, timeout);
+}
+
+/* recvfrom that spins on a non-blocking receive for up to budget
+ * microseconds before blocking in select until the socket is readable.
+ * *started is when the receive that returned began, and a select that
+ * outlasts timeout (or a signal) returns -1 with errno EAGAIN (or EINTR)
+ */
+ssize_t spin_recvfrom(int fd, void *buf, size_t len, struct sockaddr *addr, socklen_t *addrlen, size_t budget,
+    struct timeval *timeout, uint64_t *started)
+{
+  socklen_t addrsize = addrlen ? *addrlen : 0;
+  uint64_t start = microseconds();
+  ssize_t n;
+  fd_set fds;
+
+  while (1) {
+    if (addrlen) {
+      *addrlen = addrsize;
+    }
+    *started = microseconds();
+    n = recvfrom(fd, buf, len, MSG_DONTWAIT, addr, addrlen);
+    if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+      return n;
+    }
+    if (*started - start >= budget) {
+      FD_ZERO(&fds);
+      FD_SET(fd, &fds);
+      if ((n = select(fd + 1, &fds, NULL, NULL, timeout)) <= 0) {
+        errno = n ? errno : EAGAIN;
+        return -1;
+      }
+    }
+  }
+}
+
+void cpu_usage(struct cpu_usage *usage)
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  usage->user = ru.ru_utime.tv_sec * (uint64_t) 1000000 + ru.ru_utime.tv_usec;
+  usage->system = ru.ru_stime.tv_sec * (uint64_t) 1000000 + ru.ru_stime.tv_usec;
+}
+
+/* logs the cpu time spent since start, both in total and per request */
+void log_cpu_usage(FILE *logfile, int loglevel, struct cpu_usage *start, size_t requests)
+{
+  struct cpu_usage now;
+  uint64_t user, system;
+
+  cpu_usage(&now);
+  user = now.user - start->user;
+  system = now.system - start->system;
+  LOGF(logfile, loglevel, "cpu %lu us user %lu us system over %lu requests, %.2f us per request\n",
+      user, system, requests, requests ? (double)(user + system) / requests : 0.0);
+}
@@ -1,6 +1,8 @@
 #ifndef TRAFFIC_SHARED_H
 #define TRAFFIC_SHARED_H
 #include <stdint.h>
+#include <sys/select.h>
+#include <sys/types.h>
 
 #define LOG(log, level, msg)                                                 \
   do {                                                                       \
@@ -42,7 +44,12 @@ extern char *app_type;
 
 struct sockaddr;
 
+struct cpu_usage {
+  uint64_t user, system;
+};
+
 uint64_t microseconds(void);
+uint64_t nanoseconds(void);
 
 int open_socketfd(char *hostname, char* port, int flags, int type, int (*func)(int, const struct sockaddr*, socklen_t));
 void fputs2(FILE* out, char* buf, size_t n);
@@ -50,5 +57,13 @@ int fgets2(FILE* in, char* buf, size_t n);
 
 void setintsockopt(FILE* log, int loglevel, int sockfd, int level, int optname, char *optstring, int *optval);
 void logintsockopt(FILE* log, int loglevel, int sockfd, int level, int optname, char *optstring);
+
+void busy_poll_setup(FILE* log, int loglevel, int sockfd, size_t budget);
+int spin_select(int nfds, fd_set *rfds, fd_set *wfds, struct timeval *timeout, size_t budget);
+ssize_t spin_recvfrom(int sockfd, void *buf, size_t len, struct sockaddr *addr, socklen_t *addrlen, size_t budget,
+    struct timeval *timeout, uint64_t *started);
+
+void cpu_usage(struct cpu_usage *usage);
+void log_cpu_usage(FILE* log, int loglevel, struct cpu_usage *start, size_t requests);
 #endif/*TRAFFIC_SHARED_H*/
 
@@ -0,0 +1,236 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include "transport.h"
+
+struct scheme {
+  const char *name;
+  int family, type;
+};
+
+static const struct scheme schemes[] = {
+  { "tcp", AF_INET, SOCK_STREAM },
+  { "tcp6", AF_INET6, SOCK_STREAM },
+  { "udp", AF_INET, SOCK_DGRAM },
+  { "udp6", AF_INET6, SOCK_DGRAM },
+  { "unix", AF_UNIX, SOCK_STREAM },
+  { "unixgram", AF_UNIX, SOCK_DGRAM },
+  /* not a socket, see shm-ring.h */
+  { "shm", AF_UNSPEC, SOCK_STREAM },
+};
+
+static int copy(char *dst, size_t n, const char *src, size_t len)
+{
+  if (len >= n) {
+    return -1;
+  }
+  memcpy(dst, src, len);
+  dst[len] = 0;
+  return 0;
+}
+
+/* splits HOST:PORT or [HOST]:PORT */
+static int parse_host_port(struct endpoint *endpoint, const char *s)
+{
+  const char *end, *port;
+
+  if (*s == '[') {
+    end = strchr(++s, ']');
+    if (!end || end[1] != ':') {
+      return -1;
+    }
+    port = end + 2;
+  } else {
+    end = strrchr(s, ':');
+    if (!end) {
+      return -1;
+    }
+    port = end + 1;
+  }
+  if (copy(endpoint->host, sizeof(endpoint->host), s, end - s) ||
+      copy(endpoint->port, sizeof(endpoint->port), port, strlen(port))) {
+    return -1;
+  }
+  return 0;
+}
+
+static int parse_path(struct endpoint *endpoint, const char *path)
+{
+  size_t len = strlen(path);
+
+  if (!len || len >= sizeof(endpoint->unix_addr.sun_path)) {
+    return -1;
+  }
+  memset(&endpoint->unix_addr, 0, sizeof(endpoint->unix_addr));
+  endpoint->unix_addr.sun_family = AF_UNIX;
+  memcpy(endpoint->unix_addr.sun_path, path, len);
+  if (path[0] == '@') {
+    /* abstract socket, no trailing nul */
+    endpoint->unix_addr.sun_path[0] = 0;
+    endpoint->unix_len = offsetof(struct sockaddr_un, sun_path) + len;
+  } else {
+    endpoint->unix_len = offsetof(struct sockaddr_un, sun_path) + len + 1;
+  }
+  return 0;
+}
+
+/* parses url into endpoint, failing if it is not an url or names a
+ * transport that is not of the given socket type
+ */
+int endpoint_parse(struct endpoint *endpoint, const char *url, int type)
+{
+  const char *rest = strstr(url, "://");
+  size_t i;
+
+  if (!rest) {
+    return -1;
+  }
+  memset(endpoint, 0, sizeof(*endpoint));
+  for (i = 0; i < sizeof(schemes) / sizeof(*schemes); ++i) {
+    if (strlen(schemes[i].name) == rest - url && !strncmp(schemes[i].name, url, rest - url)) {
+      break;
+    }
+  }
+  if (i == sizeof(schemes) / sizeof(*schemes) || schemes[i].type != type) {
+    return -1;
+  }
+  endpoint->family = schemes[i].family;
+  endpoint->type = schemes[i].type;
+  rest += 3;
+  if (endpoint->family == AF_UNSPEC) {
+    return copy(endpoint->path, sizeof(endpoint->path), rest, strlen(rest));
+  }
+  return endpoint->family == AF_UNIX ? parse_path(endpoint, rest) : parse_host_port(endpoint, rest);
+}
+
+/* the original HOST PORT form, always ipv4 */
+int endpoint_inet(struct endpoint *endpoint, const char *host, const char *port, int type)
+{
+  memset(endpoint, 0, sizeof(*endpoint));
+  endpoint->family = AF_INET;
+  endpoint->type = type;
+  if ((host && copy(endpoint->host, sizeof(endpoint->host), host, strlen(host))) ||
+      copy(endpoint->port, sizeof(endpoint->port), port, strlen(port))) {
+    return -1;
+  }
+  return 0;
+}
+
+/* takes the endpoint from the front of argv, either as a single url or as
+ * a HOST PORT pair, returning the number of arguments used or -1
+ */
+int endpoint_args(struct endpoint *endpoint, int argc, char **argv, int type)
+{
+  if (argc >= 1 && strstr(argv[0], "://")) {
+    return endpoint_parse(endpoint, argv[0], type) ? -1 : 1;
+  }
+  if (argc >= 2) {
+    return endpoint_inet(endpoint, argv[0], argv[1], type) ? -1 : 2;
+  }
+  return -1;
+}
+
+static int open_unix(struct endpoint *endpoint, int flags, int (*func)(int, const struct sockaddr*, socklen_t))
+{
+  int socketfd;
+  sa_family_t family = AF_UNIX;
+
+  if ((socketfd = socket(AF_UNIX, endpoint->type, 0)) == -1) {
+    return -2;
+  }
+  if (flags & AI_PASSIVE) {
+    /* a stale socket file from a previous run would fail the bind */
+    if (endpoint->unix_addr.sun_path[0]) {
+      unlink(endpoint->unix_addr.sun_path);
+    }
+  } else if (endpoint->type == SOCK_DGRAM) {
+    /* autobind so that responses have an address to come back to */
+    if (bind(socketfd, (struct sockaddr*)&family, sizeof(family)) == -1) {
+      close(socketfd);
+      return -1;
+    }
+  }
+  if (func && func(socketfd, (struct sockaddr*)&endpoint->unix_addr, endpoint->unix_len) == -1) {
+    close(socketfd);
+    return -1;
+  }
+  return socketfd;
+}
+
+/* creates a socket for the endpoint and passes its address to func, which is
+ * expected to bind or connect, flags are getaddrinfo flags
+ */
+int endpoint_open(struct endpoint *endpoint, int flags, int (*func)(int, const struct sockaddr*, socklen_t))
+{
+  int socketfd;
+  struct addrinfo hints, *hostaddresses = NULL;
+
+  if (endpoint->family == AF_UNIX) {
+    return open_unix(endpoint, flags, func);
+  }
+  if (endpoint->family == AF_UNSPEC) {
+    return -2;
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_flags = AI_ADDRCONFIG | flags;
+  hints.ai_family = endpoint->family;
+  hints.ai_socktype = endpoint->type;
+  if (getaddrinfo(endpoint->host[0] ? endpoint->host : NULL, endpoint->port, &hints, &hostaddresses) != 0) {
+    return -3;
+  }
+  if ((socketfd = socket(hostaddresses->ai_family, hostaddresses->ai_socktype, hostaddresses->ai_protocol)) == -1) {
+    freeaddrinfo(hostaddresses);
+    return -2;
+  }
+  if (func && func(socketfd, hostaddresses->ai_addr, hostaddresses->ai_addrlen) == -1) {
+    freeaddrinfo(hostaddresses);
+    close(socketfd);
+    return -1;
+  }
+  freeaddrinfo(hostaddresses);
+  return socketfd;
+}
+
+int endpoint_is_inet(const struct endpoint *endpoint)
+{
+  return endpoint->family == AF_INET || endpoint->family == AF_INET6;
+}
+
+int endpoint_is_shm(const struct endpoint *endpoint)
+{
+  return endpoint->family == AF_UNSPEC;
+}
+
+/* formats an address as HOST:PORT, [HOST]:PORT or a unix path */
+void sockaddr_string(const struct sockaddr *addr, socklen_t len, char *buf, size_t n)
+{
+  char host[NI_MAXHOST], port[NI_MAXSERV];
+  const struct sockaddr_un *un = (const struct sockaddr_un*)addr;
+  size_t pathlen;
+
+  switch (addr->sa_family) {
+  case AF_INET:
+  case AF_INET6:
+    if (getnameinfo(addr, len, host, sizeof(host), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV)) {
+      snprintf(buf, n, "unknown");
+    } else {
+      snprintf(buf, n, addr->sa_family == AF_INET6 ? "[%s]:%s" : "%s:%s", host, port);
+    }
+    break;
+  case AF_UNIX:
+    pathlen = len > offsetof(struct sockaddr_un, sun_path) ? len - offsetof(struct sockaddr_un, sun_path) : 0;
+    if (!pathlen) {
+      snprintf(buf, n, "unix:unnamed");
+    } else if (!un->sun_path[0]) {
+      snprintf(buf, n, "unix:@%.*s", (int)pathlen - 1, un->sun_path + 1);
+    } else {
+      snprintf(buf, n, "unix:%.*s", (int)pathlen, un->sun_path);
+    }
+    break;
+  default:
+    snprintf(buf, n, "family %d", addr->sa_family);
+  }
+}
@@ -0,0 +1,32 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+#include <limits.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+/* a socket address named by an url
+ *   tcp://HOST:PORT        udp://HOST:PORT          ipv4
+ *   tcp6://[HOST]:PORT     udp6://[HOST]:PORT       ipv6
+ *   unix://PATH            unixgram://PATH          unix domain stream/datagram
+ *   shm://PATH                                      shared memory ring stream
+ * HOST may be empty to listen on any address and a unix PATH starting with
+ * '@' is in the abstract namespace
+ */
+struct endpoint {
+  int family, type;
+  char host[NI_MAXHOST], port[NI_MAXSERV];
+  struct sockaddr_un unix_addr;
+  socklen_t unix_len;
+  char path[PATH_MAX];
+};
+
+int endpoint_parse(struct endpoint *endpoint, const char *url, int type);
+int endpoint_inet(struct endpoint *endpoint, const char *host, const char *port, int type);
+int endpoint_args(struct endpoint *endpoint, int argc, char **argv, int type);
+int endpoint_open(struct endpoint *endpoint, int flags, int (*func)(int, const struct sockaddr*, socklen_t));
+int endpoint_is_inet(const struct endpoint *endpoint);
+int endpoint_is_shm(const struct endpoint *endpoint);
+void sockaddr_string(const struct sockaddr *addr, socklen_t len, char *buf, size_t n);
+#endif/*TRANSPORT_H*/
@@ -11,16 +11,18 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include "pacer.h"
+#include "transport.h"
 #include "udp-shared.h"
 
 struct options {
   int argc;
   char **argv;
 
-  size_t delay, requests, cleanup;
+  size_t delay, requests, cleanup, spin, pace_spin;
   char *logfilename;
   int *sopriority;
-  char *log_level, wait;
+  char *log_level, wait, pace;
 };
 
 char *app_type = "client";
@@ -28,7 +30,9 @@ static int option_true = 1;
 static int option_false = 0;
 
 static const char usage[] =
-  "usage: %s [-hqvw] [-c CLEANUP] [-d DELAY] [-s NUM_SIMUL] [-l LOGFILE] [-r REQUESTS] HOST PORT REQUEST_SIZE RESPONSE_SIZE\n"
+  "usage: %s [-hqvw] [-b SPIN] [-c CLEANUP] [-d DELAY] [-s NUM_SIMUL] [-l LOGFILE] [-r REQUESTS] [-t PACE_SPIN] (HOST PORT | ENDPOINT) REQUEST_SIZE RESPONSE_SIZE\n"
+  "  ENDPOINT    : udp://HOST:PORT, udp6://[HOST]:PORT or unixgram://PATH\n"
+  "  -b=0        : Busy poll, spinning for up to SPIN microseconds before blocking\n"
   "  -c          : How long to wait for all packets to returned (default: no limit)\n"
   "  -d=0        : Delay between consecutive requests\n"
   "  -h          : Print help and exit\n"
@@ -37,6 +41,7 @@ static const char usage[] =
   "  -P          : Disable SO_PRIORITY on socket\n"
   "  -q          : Quiet printing\n"
   "  -r          : Number of requests to send (default: no limit)\n"
+  "  -t          : Pace requests every DELAY on a fixed schedule, sleeping on a timer then spinning the last PACE_SPIN microseconds\n"
   "  -v          : Verbose printing\n"
   "  -w          : Wait for input from stdin after connecting but before sending the normal requests\n"
   ;
@@ -69,9 +74,11 @@ static int optparse(struct options *options)
 
   while (options->argc >= 2 && options->argv[0][0] == '-') {
     switch(options->argv[0][++i]) {
+    case 'b': options->spin = atoll(options->argv[n++]); break;
     case 'c': options->cleanup = atoll(options->argv[n++]) + 1; break;
     case 'd': options->delay = atoll(options->argv[n++]); break;
     case 'r': options->requests = atoll(options->argv[n++]); break;
+    case 't': options->pace = 1; options->pace_spin = atoll(options->argv[n++]); break;
     case 'l': options->logfilename = options->argv[n++]; break;
     case 'p': options->sopriority = &option_true; break;
     case 'P': options->sopriority = &option_false; break;
@@ -97,7 +104,7 @@ static int optparse(struct options *options)
   return 0;
 }
 
-static struct sockaddr_in serveraddr;
+static struct sockaddr_storage serveraddr;
 static socklen_t serveraddrlen;
 
 static int save(int fd, const struct sockaddr *addr, socklen_t len) {
@@ -109,7 +116,7 @@ static int save(int fd, const struct sockaddr *addr, socklen_t len) {
 /* main driver function */
 int main(int argc, char **argv)
 {
-  char *host, *port, *progname = argv[0];
+  char *progname = argv[0];
   FILE *logfile = NULL;
   struct options options;
   struct request *request;
@@ -117,7 +124,10 @@ int main(int argc, char **argv)
   ssize_t n;
   uint64_t readStart;
   int64_t lowerOffset = 1L << 63, upperOffset = ~(1L << 63);
-  int clientfd, error;
+  int clientfd, error, nfds, args, paced = 0;
+  struct cpu_usage cpuStart;
+  struct pacer pacer;
+  struct endpoint endpoint;
   fd_set rfds, wfds;
   struct timeval timeout, *timeout_p;
 
@@ -128,7 +138,8 @@ int main(int argc, char **argv)
 
   error = optparse(&options);
 
-  if (error || options.argc != 4) {
+  args = error ? -1 : endpoint_args(&endpoint, options.argc, options.argv, SOCK_DGRAM);
+  if (args < 0 || options.argc != args + 2) {
     fprintf(stderr, usage, progname);
     return error ? error - 1 : 0;
   }
@@ -137,10 +148,8 @@ int main(int argc, char **argv)
     logfile = fopen(options.logfilename, "a");
   }
 
-  host = options.argv[0];
-  port = options.argv[1];
-  request_size = atol(options.argv[2]);
-  response_size = atol(options.argv[3]);
+  request_size = atol(options.argv[args]);
+  response_size = atol(options.argv[args + 1]);
 
   if (request_size < sizeof(struct request)) {
     fprintf(stderr, "REQUEST_SIZE (%lu) must be at least %lu\n", request_size, sizeof(struct request));
@@ -158,7 +167,7 @@ int main(int argc, char **argv)
   memset(request, 0, buffer_size);
 
   /* looks up server and connects */
-  if ((clientfd = open_socketfd(host, port, AI_V4MAPPED, SOCK_DGRAM, &save)) < 0) {
+  if ((clientfd = endpoint_open(&endpoint, AI_V4MAPPED, &save)) < 0) {
     fprintf(stderr, "Error connecting to server %d\n", clientfd);
     return 1;
   }
@@ -170,6 +179,17 @@ int main(int argc, char **argv)
   }
 
   SETSOCKOPT(logfile, LOG_LEVEL_L, clientfd, SOL_SOCKET, SO_PRIORITY, options.sopriority);
+  busy_poll_setup(logfile, LOG_LEVEL_L, clientfd, options.spin);
+  cpu_usage(&cpuStart);
+
+  nfds = clientfd + 1;
+  if (options.pace) {
+    if (pacer_init(&pacer, options.delay, options.pace_spin) < 0) {
+      perror("timerfd_create");
+      return 1;
+    }
+    nfds = max(clientfd, pacer.timerfd) + 1;
+  }
 
   while (!options.requests || responses < options.requests) {
     delta = microseconds() - lastRequest;
@@ -183,7 +203,15 @@ int main(int argc, char **argv)
 
     if (!options.requests || requests < options.requests) {
       /* more requests to send */
-      if (delta > options.delay) {
+      if (options.pace) {
+        timeout_p = NULL;
+        if (pacer_ready(&pacer)) {
+          FD_SET(clientfd, &wfds);
+        } else {
+          pacer_arm(&pacer);
+          FD_SET(pacer.timerfd, &rfds);
+        }
+      } else if (delta > options.delay) {
         FD_SET(clientfd, &wfds);
         timeout_p = NULL;
       } else {
@@ -208,24 +236,44 @@ int main(int argc, char **argv)
     }
 
     LOG(logfile, LOG_LEVEL_V, "waiting to send messages\n");
-    select(clientfd+1, &rfds, &wfds, NULL, timeout_p);
+    spin_select(nfds, &rfds, &wfds, timeout_p, options.spin);
+
+    if (options.pace && FD_ISSET(pacer.timerfd, &rfds)) {
+      pacer_clear(&pacer);
+    }
 
     if (FD_ISSET(clientfd, &wfds)) {
       request->seq = ++requests;
       request->response_len = response_size;
+      /* a retry after EAGAIN keeps the slot it already waited for */
+      if (options.pace && !paced) {
+        pacer_wait(&pacer);
+        paced = 1;
+      }
       request->request_write_start = microseconds();
       n = sendto(clientfd, request, request_size, 0, (struct sockaddr*)&serveraddr, serveraddrlen);
       lastRequest = microseconds();
       LOGF(logfile, LOG_LEVEL_V, "sent %d bytes\n", n);
+      if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        --requests;
+        continue;
+      }
       if (n == -1) {
         fprintf(stderr, "Failed to write to socket\n");
         break;
       }
+      if (paced) {
+        pacer_sent(&pacer);
+        paced = 0;
+      }
     }
 
     if (FD_ISSET(clientfd, &rfds)) {
       readStart = microseconds();
       n = recvfrom(clientfd, request, response_size, 0, NULL, NULL);
+      if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        continue;
+      }
       if (n == -1) {
         fprintf(stderr, "Failed to read from socket\n");
         break;
@@ -253,6 +301,11 @@ int main(int argc, char **argv)
     }
   }
 
+  log_cpu_usage(logfile, LOG_LEVEL_L, &cpuStart, responses);
+  if (options.pace) {
+    log_pacer(logfile, LOG_LEVEL_L, &pacer);
+    pacer_close(&pacer);
+  }
   close(clientfd);
   if (logfile) {
     fclose(logfile);
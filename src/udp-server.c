@@ -1,6 +1,8 @@
 #define MAIN
 #include <pthread.h>
 #include <semaphore.h>
+#include <errno.h>
+#include <signal.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
 #include <stdio.h>
@@ -12,9 +14,11 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include "traffic-shared.h"
+#include "transport.h"
 #include "udp-shared.h"
 #define LISTEN_MAX 8
 #define MAXLINE 256
+#define CPU_REPORT_INTERVAL 1000000
 
 struct options {
   int argc;
@@ -23,15 +27,24 @@ struct options {
   char *logfilename;
   int *sopriority;
   char *log_level;
-  size_t max_packet_size;
+  size_t max_packet_size, spin;
 };
 
 static int option_true = 1;
 static int option_false = 0;
 char* app_type = "server";
 
+static volatile sig_atomic_t stopping;
+
+static void stop(int signum)
+{
+  stopping = 1;
+}
+
 static const char usage[] =
-  "usage: %s [-aAhnNpPqv] [-l LOGFILE] PORT\n"
+  "usage: %s [-aAhnNpPqv] [-b SPIN] [-l LOGFILE] (PORT | ENDPOINT)\n"
+  "  ENDPOINT    : udp://HOST:PORT, udp6://[HOST]:PORT or unixgram://PATH, HOST may be empty\n"
+  "  -b=0        : Busy poll, spinning for up to SPIN microseconds before blocking\n"
   "  -h          : Print help and exit\n"
   "  -l=/dev/null: Duplicate all statements to a logfile\n"
   "  -p          : Use SO_PRIORITY on socket\n"
@@ -48,6 +61,7 @@ static int optparse(struct options *options)
 
   while (options->argc >= 2 && options->argv[0][0] == '-') {
     switch(options->argv[0][++i]) {
+    case 'b': options->spin = atoll(options->argv[n++]); break;
     case 'l': options->logfilename = &options->argv[0][n++]; break;
     case 'm': options->max_packet_size = atoll(&options->argv[0][n++]);
     case 'p': options->sopriority = &option_true; break;
@@ -79,14 +93,18 @@ int main(int argc, char **argv)
 {
   char *portstring, *progname = argv[0];
   FILE *logfile = NULL;
-  fd_set fds;
+  struct cpu_usage cpuStart;
   struct options options;
   struct request *request;
-  struct sockaddr_in clientaddr;
+  struct sockaddr_storage clientaddr;
+  struct endpoint endpoint;
   int error, listenfd;
   ssize_t n;
-  uint64_t selected, readStart;
+  size_t responses = 0;
+  uint64_t selected, readStart, lastReport;
   socklen_t socklen;
+  struct timeval timeout;
+  struct sigaction action;
 
   memset(&options, 0, sizeof(struct options));
   options.argc = argc - 1;
@@ -96,6 +114,12 @@ int main(int argc, char **argv)
 
   error = optparse(&options);
 
+  if (!error && options.argc == 1 && strstr(options.argv[0], "://")) {
+    error = endpoint_parse(&endpoint, options.argv[0], SOCK_DGRAM) ? 2 : 0;
+  } else if (!error && options.argc == 1) {
+    endpoint_inet(&endpoint, NULL, options.argv[0], SOCK_DGRAM);
+  }
+
   if (error || options.argc != 1) {
     fprintf(stderr, usage, progname);
     return error ? error - 1 : 0;
@@ -116,7 +140,7 @@ int main(int argc, char **argv)
   memset(request, 0, options.max_packet_size);
 
   LOG(logfile, LOG_LEVEL_V, "Opening socket\n");
-  listenfd = open_socketfd(NULL, portstring, AI_PASSIVE, SOCK_DGRAM, &bind);
+  listenfd = endpoint_open(&endpoint, AI_PASSIVE, &bind);
   LOG(logfile, LOG_LEVEL_V, "Opened socket\n");
 
   if(listenfd < 0) {
@@ -126,16 +150,38 @@ int main(int argc, char **argv)
 
   SETSOCKOPT(logfile, LOG_LEVEL_V, listenfd, SOL_SOCKET, SO_REUSEADDR, &option_true);
   SETSOCKOPT(logfile, LOG_LEVEL_L, listenfd, SOL_SOCKET, SO_PRIORITY, options.sopriority);
-
-  while(1) {
+  busy_poll_setup(logfile, LOG_LEVEL_L, listenfd, options.spin);
+  /* the last partial interval is reported on the way out, no SA_RESTART so the wait ends */
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = stop;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  cpu_usage(&cpuStart);
+  lastReport = microseconds();
+
+  while(!stopping) {
 loop:
     selected = microseconds();
+    if (selected - lastReport >= CPU_REPORT_INTERVAL) {
+      log_cpu_usage(logfile, LOG_LEVEL_L, &cpuStart, responses);
+      lastReport = selected;
+    }
     LOG(logfile, LOG_LEVEL_V, "Waiting for requests\n");
-    select(listenfd + 1, &fds, NULL, NULL, NULL);
 
-    readStart = microseconds();
-    n = recvfrom(listenfd, request, options.max_packet_size, 0, (struct sockaddr*)&clientaddr, &socklen);
+    /* an idle server still wakes up for the next report */
+    timeout.tv_sec = (CPU_REPORT_INTERVAL - (selected - lastReport)) / 1000000;
+    timeout.tv_usec = (CPU_REPORT_INTERVAL - (selected - lastReport)) % 1000000;
+    socklen = sizeof(clientaddr);
+    n = spin_recvfrom(listenfd, request, options.max_packet_size, (struct sockaddr*)&clientaddr, &socklen, options.spin,
+        &timeout, &readStart);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+      continue;
+    }
     LOGF(logfile, LOG_LEVEL_V, "Recieved %d bytes\n", n);
+    if (n < 0) {
+      perror("recvfrom");
+      goto loop;
+    }
 
     request->request_sel = selected;
     request->request_read_start = readStart;
@@ -155,5 +201,8 @@ loop:
     request->response_write_start = microseconds();
     n = sendto(listenfd, request, request->response_len, 0, (struct sockaddr*)&clientaddr, socklen);
     LOGF(logfile, LOG_LEVEL_V, "Sent %d bytes\n", n);
+    ++responses;
   }
+  log_cpu_usage(logfile, LOG_LEVEL_L, &cpuStart, responses);
+  return 0;
 }
@@ -1,8 +1,10 @@
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
 #include <netdb.h>
+#include <linux/sockios.h>
 #include "traffic-shared.h"
 #include "udp-shared.h"
 
@@ -10,7 +12,8 @@ uint64_t rcvd_microseconds(int fd)
 {
   struct timeval tv;
   memset(&tv, 0, sizeof(tv));
-  if (ioctl(fd, SIOCGSTAMP, &tv) == -1) {
+  if (ioctl(fd, SIOCGSTAMP, &tv) == -1 && errno != ENOTTY) {
+    /* unix domain sockets have no receive timestamp and report ENOTTY */
     perror("ioctl");
   }
   return tv.tv_sec * (uint64_t) 1000000 + tv.tv_usec;